@@ -0,0 +1,297 @@
+#include "btree.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static bool writeAll(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buffer, len);
+        if (n <= 0)
+            return false;
+
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buffer, len);
+        if (n <= 0)
+            return false;
+
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool isEmptyPage(const char *page)
+{
+    for (int i = 0; i < PAGE_SIZE; i++)
+    {
+        if (page[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+copies the tree to path while it stays open. the file is read front to back in
+runs of BACKUP_RUN_PAGES, a full backup takes every page and an incremental one
+only the pages written since sinceCheckpoint. free pages may come along too,
+restoreBackup rebuilds the bitmap from the tree so they are harmless.
+
+in copy-on-write mode the backup holds a snapshot, so the pages it needs can't
+change under it and it can run on another thread while the tree is written.
+otherwise it has to be called between operations on the writer's thread.
+
+returns the checkpoint to pass to the next incremental backup, 0 on failure.
+*/
+uint64_t BTree::backup(const char *path, uint64_t sinceCheckpoint)
+{
+    if (pagerObj.fd < 0)
+    {
+        std::cerr << "Backups need a database file" << std::endl;
+        return 0;
+    }
+
+    bool incremental = sinceCheckpoint != 0;
+    if (incremental && (uint32_t)(sinceCheckpoint >> 32) != sessionId)
+    {
+        std::cerr << "Checkpoint is from an earlier session, take a full backup" << std::endl;
+        return 0;
+    }
+
+    bool cow = cache.isCopyOnWrite();
+    if (!cow)
+    {
+        flushWrites();
+        cache.sync();
+    }
+
+    std::unique_ptr<Snapshot> hold;
+    std::vector<uint32_t> epochs;
+    std::vector<CatalogEntry> catalog;
+    uint32_t epoch;
+    int root;
+    {
+        std::lock_guard<std::mutex> lock(snapshotLock);
+
+        /* pages written from here on belong to the next checkpoint */
+        epoch = changeEpoch++;
+
+        if (cow)
+        {
+            openSnapshots.insert(committedVersion);
+            hold.reset(new Snapshot(*this, committedRoot, committedVersion));
+            root = committedDefault;
+            catalog = committedCatalog;
+        }
+        else
+        {
+            root = headerObj.rootIndex;
+            catalog = headerObj.catalog;
+        }
+
+        if (incremental)
+            epochs = pageEpochs;
+    }
+
+    uint32_t since = (uint32_t)sinceCheckpoint;
+    uint64_t checkpoint = ((uint64_t)sessionId << 32) | epoch;
+
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        return 0;
+    }
+
+    char head[sizeof(int) * 2 + sizeof(uint64_t) * 2];
+    int magic = BACKUP_MAGIC;
+    memcpy(head, &magic, sizeof(int));
+    memcpy(head + sizeof(int), &root, sizeof(int));
+    memcpy(head + sizeof(int) * 2, &sinceCheckpoint, sizeof(uint64_t));
+    memcpy(head + sizeof(int) * 2 + sizeof(uint64_t), &checkpoint, sizeof(uint64_t));
+    bool ok = writeAll(out, head, sizeof(head));
+
+    /* the named trees' roots, restore marks their pages too */
+    int trees = (int)catalog.size();
+    ok = ok && writeAll(out, (const char *)&trees, sizeof(int)) &&
+         writeAll(out, (const char *)catalog.data(), sizeof(CatalogEntry) * trees);
+
+    std::vector<char> run((size_t)BACKUP_RUN_PAGES * PAGE_SIZE);
+    std::vector<char> records;
+    int pages = pagerObj.pageCount();
+
+    for (int first = 1; ok && first < pages;)
+    {
+        if (incremental)
+        {
+            while (first < pages && (epochs[first] <= since || epochs[first] > epoch))
+                first++;
+            if (first >= pages)
+                break;
+        }
+
+        int count = 1;
+        while (count < BACKUP_RUN_PAGES && first + count < pages &&
+               (!incremental || (epochs[first + count] > since && epochs[first + count] <= epoch)))
+            count++;
+
+        pagerObj.readPages(run.data(), first, count);
+
+        records.clear();
+        for (int i = 0; i < count; i++)
+        {
+            const char *page = run.data() + (size_t)i * PAGE_SIZE;
+            if (isEmptyPage(page))
+                continue;
+
+            int index = first + i;
+            records.insert(records.end(), (const char *)&index, (const char *)&index + sizeof(int));
+            records.insert(records.end(), page, page + PAGE_SIZE);
+        }
+
+        ok = writeAll(out, records.data(), records.size());
+        first += count;
+    }
+
+    int end = -1;
+    ok = ok && writeAll(out, (const char *)&end, sizeof(int)) && fsync(out) == 0;
+    close(out);
+
+    if (!ok)
+    {
+        std::cerr << "Failed to write backup " << path << std::endl;
+        return 0;
+    }
+
+    return checkpoint;
+}
+
+/*
+rebuilds filename from a full backup followed by the incremental backups taken
+after it, in order. call it on a fresh BTree in place of openFile, then init.
+*/
+bool BTree::restoreBackup(const char *filename, const std::vector<std::string> &backups)
+{
+    if (backups.empty())
+        return false;
+
+    unlink(filename);
+    pagerObj.open(filename);
+    if (pagerObj.fd < 0)
+        return false;
+
+    uint64_t last = 0;
+    int root = 0;
+    std::vector<CatalogEntry> catalog;
+    char page[PAGE_SIZE];
+
+    for (size_t b = 0; b < backups.size(); b++)
+    {
+        int in = open(backups[b].c_str(), O_RDONLY);
+        if (in < 0)
+        {
+            std::cerr << "Failed to open " << backups[b] << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        char head[sizeof(int) * 2 + sizeof(uint64_t) * 2];
+        int magic = 0;
+        uint64_t base = 0;
+        bool ok = readAll(in, head, sizeof(head));
+        memcpy(&magic, head, sizeof(int));
+        memcpy(&base, head + sizeof(int) * 2, sizeof(uint64_t));
+
+        if (!ok || (magic != BACKUP_MAGIC && magic != BACKUP_MAGIC_NO_CATALOG) || base != last)
+        {
+            std::cerr << backups[b] << " does not follow the previous backup" << std::endl;
+            close(in);
+            return false;
+        }
+
+        memcpy(&root, head + sizeof(int), sizeof(int));
+        memcpy(&last, head + sizeof(int) * 2 + sizeof(uint64_t), sizeof(uint64_t));
+
+        /* backups from before the catalog hold the default tree only */
+        int trees = 0;
+        if (magic == BACKUP_MAGIC)
+            ok = readAll(in, (char *)&trees, sizeof(int)) && trees >= 0 && trees <= MAX_TREES;
+        if (ok)
+        {
+            catalog.resize(trees);
+            ok = readAll(in, (char *)catalog.data(), sizeof(CatalogEntry) * trees);
+        }
+
+        int index;
+        while (ok && (ok = readAll(in, (char *)&index, sizeof(int))) && index != -1)
+        {
+            if (index <= 0 || index >= MAX_PAGE_COUNT || !readAll(in, page, PAGE_SIZE))
+            {
+                ok = false;
+                break;
+            }
+            pagerObj.writePage(index, page);
+        }
+        close(in);
+
+        if (!ok)
+        {
+            std::cerr << backups[b] << " is truncated" << std::endl;
+            return false;
+        }
+    }
+
+    memset(headerObj.bitmap, 0, BITMAP_SIZE);
+    bool reachable = markReachable(root);
+    for (size_t i = 0; reachable && i < catalog.size(); i++)
+        reachable = markReachable(catalog[i].root);
+
+    if (!reachable)
+    {
+        std::cerr << "Restored tree is corrupt" << std::endl;
+        return false;
+    }
+
+    headerObj.catalog = catalog;
+    headerObj.catalogDirty = true;
+    headerObj.setRootIndex(root);
+    headerObj.writeHeader();
+    pagerObj.sync();
+    return true;
+}
+
+/* marks every page of the subtree allocated in the header bitmap */
+bool BTree::markReachable(int index)
+{
+    if (index <= 0 || index >= MAX_PAGE_COUNT || headerObj.getBit(index))
+        return false;
+
+    headerObj.setIndex(index);
+
+    char page[PAGE_SIZE];
+    char scratch[PAGE_SIZE];
+    pagerObj.getPage(page, index);
+
+    BTreeNode node(true, index, *this);
+    const char *raw = PageCodec::decodePage(page, scratch);
+    if (raw == nullptr || !NodeCache::decodeNode(raw, &node))
+        return false;
+
+    if (node.isLeaf)
+        return true;
+
+    for (int i = 0; i <= node.numKeys; i++)
+    {
+        if (!markReachable(node.children[i]))
+            return false;
+    }
+    return true;
+}
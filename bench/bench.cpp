@@ -0,0 +1,447 @@
+#include "../btree.h"
+#include <cstdlib>
+
+/*
+drives a BTree with YCSB style workloads. a load phase inserts the records,
+then a run phase issues the operation mix, each phase prints one JSON line.
+
+    bench/bench --workload=a --records=20000 --ops=50000 --dist=zipf
+*/
+
+/* the YCSB zipfian generator (Gray et al.), scrambled so hot keys are spread over the key space */
+class ZipfGenerator
+{
+public:
+    ZipfGenerator(uint64_t n, double theta) : n(n), theta(theta)
+    {
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan);
+    }
+
+    uint64_t next(std::mt19937_64 &rng)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        uint64_t rank;
+
+        if (uz < 1.0)
+            rank = 0;
+        else if (uz < 1.0 + std::pow(0.5, theta))
+            rank = 1;
+        else
+            rank = (uint64_t)(n * std::pow(eta * u - eta + 1, alpha));
+
+        return fnv(std::min(rank, n - 1)) % n;
+    }
+
+private:
+    uint64_t n;
+    double theta, zetan, alpha, eta;
+
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++)
+            sum += 1.0 / std::pow((double)i, theta);
+        return sum;
+    }
+
+    static uint64_t fnv(uint64_t v)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; i++)
+        {
+            h ^= v & 0xff;
+            h *= 0x100000001b3ULL;
+            v >>= 8;
+        }
+        return h;
+    }
+};
+
+struct BenchConfig
+{
+    std::string workload = "c";
+    std::string dist = "uniform";
+    std::string file = "bench.db";
+    int records = 20000;
+    int ops = 20000;
+    int read = 100, update = 0, insert = 0, remove = 0, scan = 0;
+    int scanLength = 100;
+    int valueSize = 100;
+    int cacheSize = MAX_CACHE_SIZE;
+    double theta = 0.99;
+    uint64_t seed = 1;
+    bool compress = false;
+    bool cow = false;
+    bool lazy = false;
+    bool inMem = false;
+    bool direct = false;
+    bool hugePages = true;
+    int numaNode = -1;
+    int buffer = 0;
+    std::string changeLog;
+    int filterBits = 0;
+    int miss = 0;
+};
+
+enum BenchOp
+{
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_REMOVE,
+    OP_SCAN
+};
+
+static bool applyWorkload(BenchConfig &cfg, const std::string &name)
+{
+    /* read / update / insert / remove / scan percentages */
+    struct Preset
+    {
+        const char *name;
+        int read, update, insert, remove, scan;
+    };
+    static const Preset presets[] = {
+        {"a", 50, 50, 0, 0, 0},
+        {"b", 95, 5, 0, 0, 0},
+        {"c", 100, 0, 0, 0, 0},
+        {"e", 0, 0, 5, 0, 95},
+        {"write", 0, 0, 50, 50, 0},
+        {"load", 0, 0, 100, 0, 0},
+    };
+
+    for (const Preset &p : presets)
+    {
+        if (name == p.name)
+        {
+            cfg.workload = name;
+            cfg.read = p.read;
+            cfg.update = p.update;
+            cfg.insert = p.insert;
+            cfg.remove = p.remove;
+            cfg.scan = p.scan;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage()
+{
+    std::cerr << "usage: bench [--workload=a|b|c|e|write|load] [--records=N] [--ops=N]\n"
+                 "             [--dist=seq|uniform|zipf] [--theta=F] [--read=P --update=P --insert=P --remove=P --scan=P]\n"
+                 "             [--scan-length=N] [--value-size=N] [--cache=N] [--seed=N]\n"
+                 "             [--file=PATH] [--memory] [--direct] [--compress] [--cow] [--lazy]\n"
+                 "             [--filter=BITS_PER_KEY] [--miss=P] [--small-pages] [--numa=NODE]\n"
+                 "             [--buffer=MESSAGES] [--change-log=PATH]\n";
+}
+
+static bool parseArgs(int argc, char **argv, BenchConfig &cfg)
+{
+    bool cacheGiven = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (key == "--workload" && applyWorkload(cfg, value))
+            continue;
+        else if (key == "--dist" && (value == "seq" || value == "uniform" || value == "zipf"))
+            cfg.dist = value;
+        else if (key == "--records")
+            cfg.records = atoi(value.c_str());
+        else if (key == "--ops")
+            cfg.ops = atoi(value.c_str());
+        else if (key == "--read")
+            cfg.read = atoi(value.c_str()), cfg.workload = "custom";
+        else if (key == "--update")
+            cfg.update = atoi(value.c_str()), cfg.workload = "custom";
+        else if (key == "--insert")
+            cfg.insert = atoi(value.c_str()), cfg.workload = "custom";
+        else if (key == "--remove")
+            cfg.remove = atoi(value.c_str()), cfg.workload = "custom";
+        else if (key == "--scan")
+            cfg.scan = atoi(value.c_str()), cfg.workload = "custom";
+        else if (key == "--scan-length")
+            cfg.scanLength = atoi(value.c_str());
+        else if (key == "--value-size")
+            cfg.valueSize = atoi(value.c_str());
+        else if (key == "--cache")
+            cfg.cacheSize = atoi(value.c_str()), cacheGiven = true;
+        else if (key == "--theta")
+            cfg.theta = atof(value.c_str());
+        else if (key == "--seed")
+            cfg.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--file")
+            cfg.file = value;
+        else if (key == "--memory")
+            cfg.inMem = true;
+        else if (key == "--direct")
+            cfg.direct = true;
+        else if (key == "--small-pages")
+            cfg.hugePages = false;
+        else if (key == "--numa")
+            cfg.numaNode = atoi(value.c_str());
+        else if (key == "--buffer")
+            cfg.buffer = atoi(value.c_str());
+        else if (key == "--change-log")
+            cfg.changeLog = value;
+        else if (key == "--compress")
+            cfg.compress = true;
+        else if (key == "--cow")
+            cfg.cow = true;
+        else if (key == "--lazy")
+            cfg.lazy = true;
+        else if (key == "--filter")
+            cfg.filterBits = atoi(value.c_str());
+        else if (key == "--miss")
+            cfg.miss = atoi(value.c_str());
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    /* memory mode holds every node, unless --cache limits it and the rest spill to a temporary file */
+    if (cfg.inMem && !cacheGiven)
+        cfg.cacheSize = 0;
+
+    if (cfg.read + cfg.update + cfg.insert + cfg.remove + cfg.scan != 100)
+    {
+        std::cerr << "Operation mix must add up to 100" << std::endl;
+        return false;
+    }
+    if (cfg.records < 1 || cfg.ops < 0)
+    {
+        std::cerr << "Need at least one record" << std::endl;
+        return false;
+    }
+    if (cfg.valueSize < 1 || cfg.valueSize >= (int)DATA_SIZE)
+    {
+        std::cerr << "Value size must be between 1 and " << DATA_SIZE - 1 << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* a value of the configured size, mostly repeated so compression has something to do */
+static void fillValue(char *buffer, int size, int key, std::mt19937_64 &rng)
+{
+    memset(buffer, 0, DATA_SIZE);
+    int n = snprintf(buffer, size + 1, "%d:", key);
+    for (int i = std::min(n, size); i < size; i++)
+        buffer[i] = 'a' + (rng() % 4 == 0 ? rng() % 26 : i % 26);
+}
+
+struct PhaseResult
+{
+    uint64_t ops = 0;
+    uint64_t found = 0;
+    double seconds = 0;
+    LatencyHistogram latency;
+};
+
+static void report(const char *phase, const BenchConfig &cfg, BTree &btree, const PhaseResult &r,
+                   const StatsSnapshot &before, const StatsSnapshot &after)
+{
+    double ops = r.ops > 0 ? (double)r.ops : 1.0;
+    uint64_t delta[STAT_COUNT];
+    for (int c = 0; c < STAT_COUNT; c++)
+        delta[c] = after.counters[c] - before.counters[c];
+
+    uint64_t lookups = delta[STAT_CACHE_HITS] + delta[STAT_CACHE_MISSES];
+
+    printf("{\"phase\":\"%s\",\"workload\":\"%s\",\"dist\":\"%s\",\"records\":%d,"
+           "\"value_size\":%d,\"cache\":%d,\"compress\":%s,\"cow\":%s,\"lazy\":%s,\"memory\":%s,\"direct\":%s,"
+           "\"filter\":%d,\"miss\":%d,\"numa\":%d,\"buffer\":%d,\"change_log\":%s,\"huge_page_bytes\":%zu,"
+           "\"ops\":%llu,\"found\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,"
+           "\"pages_read\":%llu,\"pages_written\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,"
+           "\"fsyncs\":%llu,\"bytes_read_per_op\":%.1f,\"bytes_written_per_op\":%.1f,\"fsyncs_per_op\":%.4f,"
+           "\"cache_hit_ratio\":%.4f,\"evictions\":%llu,\"splits\":%llu,\"merges\":%llu,\"filter_skips\":%llu}\n",
+           phase, cfg.workload.c_str(), cfg.dist.c_str(), cfg.records,
+           cfg.valueSize, cfg.cacheSize, cfg.compress ? "true" : "false", cfg.cow ? "true" : "false",
+           cfg.lazy ? "true" : "false", cfg.inMem ? "true" : "false", cfg.direct ? "true" : "false", cfg.filterBits, cfg.miss,
+           cfg.numaNode, cfg.buffer, cfg.changeLog.empty() ? "false" : "true", btree.nodeCache().hugePageBytes(),
+           (unsigned long long)r.ops, (unsigned long long)r.found, r.seconds,
+           r.seconds > 0 ? r.ops / r.seconds : 0.0,
+           r.latency.percentile(0.50) / 1000.0, r.latency.percentile(0.99) / 1000.0,
+           r.latency.percentile(0.999) / 1000.0, r.latency.max() / 1000.0,
+           (unsigned long long)delta[STAT_PAGES_READ],
+           (unsigned long long)delta[STAT_PAGES_WRITTEN],
+           (unsigned long long)delta[STAT_BYTES_READ],
+           (unsigned long long)delta[STAT_BYTES_WRITTEN],
+           (unsigned long long)delta[STAT_SYNCS],
+           delta[STAT_BYTES_READ] / ops,
+           delta[STAT_BYTES_WRITTEN] / ops,
+           delta[STAT_SYNCS] / ops,
+           lookups > 0 ? (double)delta[STAT_CACHE_HITS] / lookups : 0.0,
+           (unsigned long long)delta[STAT_EVICTIONS],
+           (unsigned long long)delta[STAT_SPLITS],
+           (unsigned long long)delta[STAT_MERGES],
+           (unsigned long long)delta[STAT_FILTER_SKIPS]);
+    fflush(stdout);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t elapsedNs(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg;
+    if (!parseArgs(argc, argv, cfg))
+    {
+        usage();
+        return 1;
+    }
+
+    BTree btree;
+    btree.setCacheSize(cfg.cacheSize);
+    if (cfg.inMem)
+        btree.setMemoryLimit(cfg.cacheSize);
+    btree.setDirectIO(cfg.direct);
+    btree.setHugePages(cfg.hugePages);
+    btree.setNumaNode(cfg.numaNode);
+    if (cfg.compress)
+        btree.setCompression(COMPRESSION_LZ);
+    if (cfg.cow)
+        btree.setCopyOnWrite(true);
+    if (cfg.lazy)
+        btree.setLazyDelete(true);
+    if (cfg.filterBits > 0)
+        btree.setKeyFilter(cfg.filterBits);
+    if (cfg.buffer > 0)
+        btree.setWriteBuffer(cfg.buffer);
+    if (!cfg.changeLog.empty() && !btree.openChangeLog(cfg.changeLog.c_str()))
+        return 1;
+
+    if (cfg.inMem)
+    {
+        btree.init(true, true);
+    }
+    else
+    {
+        std::remove(cfg.file.c_str());
+        btree.init(!btree.openFile(cfg.file.c_str()), false);
+    }
+
+    std::mt19937_64 rng(cfg.seed);
+    char value[DATA_SIZE];
+    char result[DATA_SIZE];
+
+    /* load phase: sequential keys go in ascending order, otherwise shuffled */
+    std::vector<int> order(cfg.records);
+    for (int i = 0; i < cfg.records; i++)
+        order[i] = i;
+    if (cfg.dist != "seq")
+        std::shuffle(order.begin(), order.end(), rng);
+
+    PhaseResult load;
+    StatsSnapshot before = btree.stats();
+    Clock::time_point phaseStart = Clock::now();
+
+    for (int key : order)
+    {
+        fillValue(value, cfg.valueSize, key, rng);
+        Clock::time_point start = Clock::now();
+        btree.insert(key, value);
+        load.latency.record(elapsedNs(start));
+        load.ops++;
+    }
+
+    /* buffered writes count against the phase that made them */
+    btree.flushWrites();
+    load.seconds = elapsedNs(phaseStart) / 1e9;
+    report("load", cfg, btree, load, before, btree.stats());
+
+    /* run phase */
+    ZipfGenerator zipf(cfg.records, cfg.theta);
+    int nextKey = cfg.records;
+    uint64_t cursor = 0;
+
+    PhaseResult run;
+    before = btree.stats();
+    phaseStart = Clock::now();
+
+    for (int i = 0; i < cfg.ops; i++)
+    {
+        int roll = (int)(rng() % 100);
+        BenchOp op = roll < cfg.read                                           ? OP_READ
+                     : roll < cfg.read + cfg.update                            ? OP_UPDATE
+                     : roll < cfg.read + cfg.update + cfg.insert               ? OP_INSERT
+                     : roll < cfg.read + cfg.update + cfg.insert + cfg.remove ? OP_REMOVE
+                                                                                : OP_SCAN;
+
+        int key;
+        if (cfg.dist == "seq")
+            key = (int)(cursor++ % nextKey);
+        else if (cfg.dist == "zipf")
+            key = (int)zipf.next(rng);
+        else
+            key = (int)(rng() % nextKey);
+
+        if (op == OP_INSERT)
+            key = nextKey++;
+
+        /* --miss percent of reads look for keys that were never inserted */
+        if (op == OP_READ && cfg.miss > 0 && (int)(rng() % 100) < cfg.miss)
+            key = -1 - key;
+        if (op == OP_INSERT || op == OP_UPDATE)
+            fillValue(value, cfg.valueSize, key, rng);
+
+        Clock::time_point start = Clock::now();
+
+        switch (op)
+        {
+        case OP_READ:
+            run.found += btree.get(key, result);
+            break;
+        case OP_UPDATE:
+            run.found += btree.update(key, [&](char *data, bool found) {
+                if (!found)
+                    return false;
+
+                memcpy(data, value, DATA_SIZE);
+                return true;
+            });
+            break;
+        case OP_INSERT:
+            btree.insert(key, value);
+            break;
+        case OP_REMOVE:
+            btree.remove(key);
+            break;
+        case OP_SCAN:
+        {
+            int seen = 0;
+            btree.scan(key, INT32_MAX, [&](int, const char *) { return ++seen < cfg.scanLength; });
+            run.found += seen;
+            break;
+        }
+        }
+
+        run.latency.record(elapsedNs(start));
+        run.ops++;
+    }
+
+    btree.flushWrites();
+    run.seconds = elapsedNs(phaseStart) / 1e9;
+    report("run", cfg, btree, run, before, btree.stats());
+
+    if (!cfg.inMem)
+    {
+        btree.pager().deleteFile();
+        std::remove(cfg.file.c_str());
+    }
+    return 0;
+}
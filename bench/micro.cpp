@@ -0,0 +1,450 @@
+#include "../btree.h"
+#include <cstdlib>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+micro benchmarks for the node level kernels: findKey, the leaf insert shift,
+splitChild, node (de)serialization and the page codec. every kernel is warmed
+up, then timed in MICRO_SAMPLES samples and reported as one JSON line with the
+spread of the per operation cost and, where perf_event_open is allowed, cache
+and branch misses per operation.
+
+the right_edge check runs the append fast path through a declined write and
+exits 1 if the tree comes out wrong.
+
+fanout is fixed at build time, compare fanouts with
+    make clean && make micro MAX_KEYS=32 && bench/micro
+*/
+
+#define MICRO_SAMPLES 200
+#define MICRO_WARMUP 20
+#define MICRO_BATCH 1024
+
+/* cycle counter, the lfence keeps earlier instructions from leaking into the timed region */
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence\n\trdtsc" : "=a"(lo), "=d"(hi)::"memory");
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return Stats::now();
+#endif
+}
+
+/* hardware counters for the timed regions only, user space only */
+class PerfCounters
+{
+public:
+    enum
+    {
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        COUNT
+    };
+
+    PerfCounters() : leader(-1)
+    {
+        for (int i = 0; i < COUNT; i++)
+            fds[i] = -1;
+
+        const uint64_t configs[COUNT] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                         PERF_COUNT_HW_BRANCH_MISSES};
+
+        for (int i = 0; i < COUNT; i++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd < 0)
+            {
+                close();
+                return;
+            }
+            fds[i] = fd;
+            if (i == 0)
+                leader = fd;
+        }
+    }
+
+    ~PerfCounters() { close(); }
+
+    bool available() const { return leader >= 0; }
+
+    void start()
+    {
+        if (leader >= 0)
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void stop()
+    {
+        if (leader >= 0)
+            ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void reset()
+    {
+        if (leader >= 0)
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    }
+
+    bool read(uint64_t values[COUNT])
+    {
+        uint64_t buffer[1 + COUNT];
+        if (leader < 0 || ::read(leader, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer))
+            return false;
+
+        for (int i = 0; i < COUNT; i++)
+            values[i] = buffer[1 + i];
+        return true;
+    }
+
+private:
+    int leader;
+    int fds[COUNT];
+
+    void close()
+    {
+        if (leader < 0)
+            return;
+
+        for (int i = 0; i < COUNT; i++)
+        {
+            if (fds[i] >= 0)
+                ::close(fds[i]);
+        }
+        leader = -1;
+    }
+};
+
+struct MicroResult
+{
+    std::vector<double> samples;
+    uint64_t ops = 0;
+    uint64_t perf[PerfCounters::COUNT] = {0, 0, 0};
+    bool havePerf = false;
+};
+
+static double timerOverhead = 0;
+static double nsPerCycle = 1;
+
+/*
+times body(i) for ops operations per sample. setup runs before each sample
+outside the timed region, for kernels that consume their input.
+*/
+template <typename Setup, typename Body>
+static MicroResult measure(PerfCounters &perf, int opsPerSample, Setup setup, Body body)
+{
+    MicroResult result;
+    perf.reset();
+
+    for (int s = 0; s < MICRO_WARMUP + MICRO_SAMPLES; s++)
+    {
+        setup();
+
+        bool timed = s >= MICRO_WARMUP;
+        if (timed)
+            perf.start();
+
+        uint64_t start = cycles();
+        for (int i = 0; i < opsPerSample; i++)
+            body(i);
+        uint64_t end = cycles();
+
+        if (!timed)
+            continue;
+
+        perf.stop();
+        double perOp = ((double)(end - start) - timerOverhead) / opsPerSample;
+        result.samples.push_back(perOp > 0 ? perOp : 0);
+        result.ops += opsPerSample;
+    }
+
+    result.havePerf = perf.read(result.perf);
+    return result;
+}
+
+static void calibrate()
+{
+    /* cost of an empty timed region */
+    std::vector<uint64_t> empty;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = cycles();
+        uint64_t end = cycles();
+        empty.push_back(end - start);
+    }
+    std::sort(empty.begin(), empty.end());
+    timerOverhead = empty[empty.size() / 2];
+
+    /* cycle counter rate, over 50ms */
+    uint64_t ns0 = Stats::now();
+    uint64_t c0 = cycles();
+    while (Stats::now() - ns0 < 50000000)
+        ;
+    nsPerCycle = (double)(Stats::now() - ns0) / (cycles() - c0);
+}
+
+static void report(const char *kernel, const char *dist, int fill, MicroResult &r)
+{
+    std::vector<double> &v = r.samples;
+    std::sort(v.begin(), v.end());
+
+    double mean = 0;
+    for (double x : v)
+        mean += x;
+    mean /= v.size();
+
+    double var = 0;
+    for (double x : v)
+        var += (x - mean) * (x - mean);
+    double stddev = std::sqrt(var / v.size());
+
+    printf("{\"kernel\":\"%s\",\"dist\":\"%s\",\"max_keys\":%d,\"data_size\":%d,\"fill\":%d,"
+           "\"samples\":%zu,\"ops\":%llu,\"cycles_min\":%.2f,\"cycles_p10\":%.2f,\"cycles_median\":%.2f,"
+           "\"cycles_p90\":%.2f,\"cycles_mean\":%.2f,\"cycles_stddev\":%.2f,\"ns_median\":%.2f",
+           kernel, dist, MAX_KEYS, (int)DATA_SIZE, fill, v.size(), (unsigned long long)r.ops,
+           v.front(), v[v.size() / 10], v[v.size() / 2], v[v.size() * 9 / 10], mean, stddev,
+           v[v.size() / 2] * nsPerCycle);
+
+    if (r.havePerf && r.ops > 0)
+    {
+        printf(",\"instructions_per_op\":%.2f,\"cache_misses_per_op\":%.4f,\"branch_misses_per_op\":%.4f}\n",
+               (double)r.perf[PerfCounters::INSTRUCTIONS] / r.ops,
+               (double)r.perf[PerfCounters::CACHE_MISSES] / r.ops,
+               (double)r.perf[PerfCounters::BRANCH_MISSES] / r.ops);
+    }
+    else
+    {
+        printf(",\"instructions_per_op\":null,\"cache_misses_per_op\":null,\"branch_misses_per_op\":null}\n");
+    }
+    fflush(stdout);
+}
+
+/* keys 0, 2, 4 ... so lookups hit and miss alike */
+static void fillNode(BTreeNode *node, int n)
+{
+    node->numKeys = n;
+    for (int i = 0; i < n; i++)
+    {
+        node->keys[i].key = i * 2;
+        memset(node->keys[i].data, 'a' + i % 26, DATA_SIZE);
+    }
+}
+
+/* lookup keys for findKey: uniform over the node, ascending, or mostly the first few slots */
+static std::vector<int> lookupKeys(const char *dist, int n, std::mt19937 &rng)
+{
+    std::vector<int> keys(MICRO_BATCH);
+    for (int i = 0; i < MICRO_BATCH; i++)
+    {
+        if (strcmp(dist, "seq") == 0)
+            keys[i] = i % (2 * n + 1);
+        else if (strcmp(dist, "skewed") == 0)
+            keys[i] = rng() % 8 == 0 ? rng() % (2 * n + 1) : rng() % 4;
+        else
+            keys[i] = rng() % (2 * n + 1);
+    }
+    return keys;
+}
+
+/*
+a full right-edge leaf is split before the write that declined to store in it,
+the appends after it have to land right of the new separator. runs the sequence
+on a fresh file and reports whether verify, the scan order and a lookup hold.
+*/
+static bool rightEdgeCheck(const char *how, const std::function<void(BTree &)> &decline)
+{
+    const char *file = "micro.db";
+    bool ok;
+    int inOrder = 1;
+    {
+        std::remove(file);
+        BTree btree;
+        btree.init(!btree.openFile(file), false);
+
+        char data[DATA_SIZE];
+        memset(data, 'x', DATA_SIZE);
+        for (int k = 1; k < 2 * t; k++)
+            btree.insert(k, data);
+
+        decline(btree);
+        for (int k = 1001; k < 1030; k++)
+            btree.insert(k, data);
+
+        int prev = INT_MIN;
+        btree.scan(INT_MIN, INT_MAX, [&](int key, const char *) {
+            inOrder &= key > prev;
+            prev = key;
+            return true;
+        });
+
+        char result[DATA_SIZE];
+        ok = btree.verify() && inOrder && btree.get(1001, result) && !btree.get(1000, result);
+    }
+    std::remove(file);
+
+    printf("{\"check\":\"right_edge\",\"declined\":\"%s\",\"max_keys\":%d,\"ok\":%s}\n", how, MAX_KEYS,
+           ok ? "true" : "false");
+    fflush(stdout);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : nullptr;
+    const char *dists[] = {"uniform", "seq", "skewed"};
+
+    BTree btree;
+    btree.setCacheSize(64);
+    btree.init(true, true);
+
+    NodeCache &cache = btree.nodeCache();
+    PerfCounters perf;
+    std::mt19937 rng(1);
+    volatile int sink = 0;
+
+    calibrate();
+    if (!perf.available())
+        std::cerr << "perf_event_open unavailable, hardware counters are not reported" << std::endl;
+
+    BTreeNode *leaf = cache.create(true, btree.header().nextFree());
+    char data[DATA_SIZE];
+    memset(data, 'x', DATA_SIZE);
+
+    int fills[] = {t - 1, MAX_KEYS / 2 + 1, 2 * t - 1};
+
+    if (only == nullptr || strcmp(only, "find_key") == 0)
+    {
+        for (int fill : fills)
+        {
+            for (const char *dist : dists)
+            {
+                fillNode(leaf, fill);
+                std::vector<int> keys = lookupKeys(dist, fill, rng);
+                MicroResult r = measure(
+                    perf, MICRO_BATCH, [] {},
+                    [&](int i) { sink += leaf->findKey(keys[i]); });
+                report("find_key", dist, fill, r);
+            }
+        }
+    }
+
+    /* insert into a leaf one short of full, then drop the last key so the next insert shifts as far */
+    if (only == nullptr || strcmp(only, "leaf_insert") == 0)
+    {
+        for (const char *dist : dists)
+        {
+            int fill = MAX_KEYS - 1;
+            fillNode(leaf, fill);
+            std::vector<int> keys = lookupKeys(dist, fill, rng);
+            for (int &k : keys)
+                k |= 1;
+
+            MicroResult r = measure(
+                perf, MICRO_BATCH, [] {},
+                [&](int i) {
+                    leaf->numKeys = fill;
+                    leaf->insertNonFull(keys[i], data);
+                });
+            report("leaf_insert", dist, fill, r);
+        }
+    }
+
+    /* one split per sample, the full child is rebuilt and the new sibling freed outside the timing */
+    if (only == nullptr || strcmp(only, "split_child") == 0)
+    {
+        BTreeNode *parent = cache.create(false, btree.header().nextFree());
+        BTreeNode *child = leaf;
+        BTreeNode *sibling = nullptr;
+
+        MicroResult r = measure(
+            perf, 1,
+            [&] {
+                if (sibling != nullptr)
+                    cache.destroy(sibling);
+                fillNode(child, 2 * t - 1);
+                parent->numKeys = 0;
+                parent->children[0] = child->index;
+            },
+            [&](int) {
+                parent->splitChild(0, child);
+                sibling = cache.get(parent->children[1]);
+            });
+        report("split_child", "n/a", 2 * t - 1, r);
+
+        cache.destroy(sibling);
+        cache.destroy(parent);
+    }
+
+    char page[PAGE_SIZE];
+    char encoded[PAGE_SIZE];
+    char scratch[PAGE_SIZE];
+
+    if (only == nullptr || strcmp(only, "serialize") == 0)
+    {
+        for (int fill : fills)
+        {
+            fillNode(leaf, fill);
+            MicroResult r = measure(
+                perf, MICRO_BATCH / 16, [] {},
+                [&](int) { NodeCache::serializeNode(leaf, page); });
+            report("serialize", "n/a", fill, r);
+
+            BTreeNode decoded(true, 0, btree);
+            MicroResult d = measure(
+                perf, MICRO_BATCH / 16, [] {},
+                [&](int) { sink += NodeCache::decodeNode(page, &decoded); });
+            report("deserialize", "n/a", fill, d);
+        }
+    }
+
+    if (only == nullptr || strcmp(only, "codec") == 0)
+    {
+        for (int fill : fills)
+        {
+            fillNode(leaf, fill);
+            NodeCache::serializeNode(leaf, page);
+
+            MicroResult r = measure(
+                perf, 16, [] {},
+                [&](int) { sink += PageCodec::encodePage(COMPRESSION_LZ, page, encoded); });
+            report("lz_encode", "n/a", fill, r);
+
+            MicroResult d = measure(
+                perf, 16, [] {},
+                [&](int) { sink += PageCodec::decodePage(encoded, scratch) != nullptr; });
+            report("lz_decode", "n/a", fill, d);
+        }
+    }
+
+    bool checked = true;
+    if (only == nullptr || strcmp(only, "right_edge") == 0)
+    {
+        checked &= rightEdgeCheck("cas", [](BTree &b) {
+            char expected[DATA_SIZE];
+            char data[DATA_SIZE];
+            memset(expected, 'e', DATA_SIZE);
+            memset(data, 'd', DATA_SIZE);
+            b.compareAndSwap(1000, expected, data);
+        });
+        checked &= rightEdgeCheck("update", [](BTree &b) {
+            b.update(1000, [](char *, bool) { return false; });
+        });
+    }
+
+    return !checked || sink == 42 ? 1 : 0;
+}
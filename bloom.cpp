@@ -0,0 +1,233 @@
+#include "btree.h"
+
+/* the fields at the front of a saved filter's first page, the data page list follows */
+struct FilterImage
+{
+    int magic;
+    int bitsPerKey;
+    int hashes;
+    int dataPages;
+    int64_t capacity;
+    int64_t keys;
+    int64_t removed;
+    uint64_t words;
+    uint64_t checksum;
+};
+
+#define FILTER_MAX_DATA_PAGES ((int)((PAGE_SIZE - sizeof(FilterImage)) / sizeof(int)))
+
+/* splitmix64 finaliser, keys are often sequential so every bit has to depend on every key bit */
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t checksum(const std::vector<uint64_t> &words)
+{
+    uint64_t sum = FILTER_MAGIC;
+    for (uint64_t w : words)
+        sum = mix(sum ^ w);
+    return sum;
+}
+
+/* sizes the filter for capacity keys and empties it, 0 bits per key turns it off */
+void BloomFilter::reset(int bits, int64_t cap)
+{
+    bitsPerKey = bits;
+    keys = 0;
+    removed = 0;
+
+    if (bits <= 0)
+    {
+        capacity = 0;
+        hashes = 0;
+        blocks.clear();
+        blocks.shrink_to_fit();
+        return;
+    }
+
+    /* ln 2 hashes per bit per key gives the fewest false positives */
+    capacity = std::max<int64_t>(cap, FILTER_MIN_KEYS);
+    hashes = std::min(16, std::max(1, (int)std::lround(bits * 0.69)));
+
+    int64_t count = (capacity * bits + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS;
+    blocks.assign((size_t)count * FILTER_BLOCK_WORDS, 0);
+}
+
+void BloomFilter::clear()
+{
+    std::fill(blocks.begin(), blocks.end(), 0);
+    keys = 0;
+    removed = 0;
+}
+
+/* picks the block from the high half of the hash, without a division */
+size_t BloomFilter::blockOf(uint64_t hash) const
+{
+    uint64_t count = blocks.size() / FILTER_BLOCK_WORDS;
+    return (size_t)(((hash >> 32) * count) >> 32) * FILTER_BLOCK_WORDS;
+}
+
+void BloomFilter::add(int k)
+{
+    if (blocks.empty())
+        return;
+
+    uint64_t h = mix((uint32_t)k);
+    uint64_t *words = &blocks[blockOf(h)];
+
+    /* double hashing within the block, each probe takes the top 9 bits */
+    uint32_t a = (uint32_t)h;
+    uint32_t b = ((a >> 17) | (a << 15)) | 1;
+    for (int i = 0; i < hashes; i++, a += b)
+    {
+        uint32_t bit = a >> 23;
+        words[bit >> 6] |= 1ull << (bit & 63);
+    }
+}
+
+bool BloomFilter::mayContain(int k) const
+{
+    if (blocks.empty())
+        return true;
+
+    uint64_t h = mix((uint32_t)k);
+    const uint64_t *words = &blocks[blockOf(h)];
+
+    uint32_t a = (uint32_t)h;
+    uint32_t b = ((a >> 17) | (a << 15)) | 1;
+    for (int i = 0; i < hashes; i++, a += b)
+    {
+        uint32_t bit = a >> 23;
+        if ((words[bit >> 6] & (1ull << (bit & 63))) == 0)
+            return false;
+    }
+    return true;
+}
+
+/* deleted keys keep their bits, so they count against capacity until the next rebuild */
+bool BloomFilter::isStale() const
+{
+    return enabled() && (keys > capacity || (keys > FILTER_MIN_KEYS && removed > keys / 2));
+}
+
+/* writes the filter to freshly allocated pages, returns the first one or 0 */
+int BloomFilter::save(Pager &pager, Header &header)
+{
+    size_t bytes = blocks.size() * sizeof(uint64_t);
+    int dataPages = (int)((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!enabled() || dataPages > FILTER_MAX_DATA_PAGES)
+        return 0;
+
+    int first = header.nextFree();
+    if (first < 0)
+        return 0;
+
+    char page[PAGE_SIZE];
+    memset(page, 0, PAGE_SIZE);
+    FilterImage image = {FILTER_MAGIC, bitsPerKey, hashes, dataPages, capacity,
+                         keys, removed, blocks.size(), checksum(blocks)};
+    memcpy(page, &image, sizeof(image));
+
+    const char *raw = (const char *)blocks.data();
+    char data[PAGE_SIZE];
+    for (int i = 0; i < dataPages; i++)
+    {
+        int index = header.nextFree();
+        if (index < 0)
+        {
+            std::cerr << "No free pages to save the key filter" << std::endl;
+            for (int j = 0; j < i; j++)
+            {
+                memcpy(&index, page + sizeof(image) + j * sizeof(int), sizeof(int));
+                header.freeIndex(index);
+            }
+            header.freeIndex(first);
+            return 0;
+        }
+
+        size_t offset = (size_t)i * PAGE_SIZE;
+        size_t len = std::min((size_t)PAGE_SIZE, bytes - offset);
+        memset(data, 0, PAGE_SIZE);
+        memcpy(data, raw + offset, len);
+        pager.writePage(index, data);
+        memcpy(page + sizeof(image) + i * sizeof(int), &index, sizeof(int));
+    }
+
+    pager.writePage(first, page);
+    return first;
+}
+
+/* reads a filter saved by save, false if the image is missing or damaged */
+bool BloomFilter::load(Pager &pager, int first)
+{
+    char page[PAGE_SIZE];
+    pager.getPage(page, first);
+
+    FilterImage image;
+    memcpy(&image, page, sizeof(image));
+    if (image.magic != FILTER_MAGIC || image.bitsPerKey <= 0 || image.dataPages <= 0 ||
+        image.dataPages > FILTER_MAX_DATA_PAGES || image.words == 0 || image.words % FILTER_BLOCK_WORDS != 0 ||
+        image.words * sizeof(uint64_t) > (uint64_t)image.dataPages * PAGE_SIZE)
+        return false;
+
+    std::vector<uint64_t> words(image.words);
+    char *raw = (char *)words.data();
+    size_t bytes = words.size() * sizeof(uint64_t);
+    char data[PAGE_SIZE];
+
+    for (int i = 0; i < image.dataPages; i++)
+    {
+        int index;
+        memcpy(&index, page + sizeof(image) + i * sizeof(int), sizeof(int));
+        if (index <= 0 || index >= MAX_PAGE_COUNT)
+            return false;
+
+        size_t offset = (size_t)i * PAGE_SIZE;
+        pager.getPage(data, index);
+        memcpy(raw + offset, data, std::min((size_t)PAGE_SIZE, bytes - offset));
+    }
+
+    if (checksum(words) != image.checksum)
+        return false;
+
+    blocks.swap(words);
+    bitsPerKey = image.bitsPerKey;
+    hashes = image.hashes;
+    capacity = image.capacity;
+    keys = image.keys;
+    removed = image.removed;
+    return true;
+}
+
+/* the pages of a saved filter, first page included, none if first doesn't hold one */
+std::vector<int> BloomFilter::pages(Pager &pager, int first)
+{
+    std::vector<int> result;
+    char page[PAGE_SIZE];
+    pager.getPage(page, first);
+
+    FilterImage image;
+    memcpy(&image, page, sizeof(image));
+    if (image.magic != FILTER_MAGIC || image.dataPages < 0 || image.dataPages > FILTER_MAX_DATA_PAGES)
+        return result;
+
+    result.push_back(first);
+    for (int i = 0; i < image.dataPages; i++)
+    {
+        int index;
+        memcpy(&index, page + sizeof(image) + i * sizeof(int), sizeof(int));
+        result.push_back(index);
+    }
+    return result;
+}
+
+/* frees the pages of a saved filter */
+void BloomFilter::release(Pager &pager, Header &header, int first)
+{
+    for (int index : pages(pager, first))
+        header.freeIndex(index);
+}
@@ -2,10 +2,34 @@
 #include <iostream>
 
 BTree::BTree()
-    : headerObj(pagerObj),
-      cache(pagerObj, headerObj),
-      root(nullptr)
+    : pagerObj(statsObj),
+      headerObj(pagerObj),
+      cache(pagerObj, headerObj, statsObj),
+      pageEpochs(MAX_PAGES, 0)
 {
+    /* checkpoints only mean something within the session that handed them out */
+    std::random_device rd;
+    sessionId = rd() | 1;
+
+    /* without a change log each session numbers its changes apart from the others, so none resume into another */
+    changeFeed.startAt((uint64_t)sessionId << 32);
+}
+
+BTree::~BTree()
+{
+    flushWrites();
+
+    /* the saved filter is the default tree's */
+    if (activeTree >= 0)
+        useTree(nullptr);
+    saveFilter();
+
+    if (warmup && !cache.isInMemMode && pagerObj.fd >= 0 && headerObj.rootIndex > 0)
+    {
+        cache.saveWarmup();
+        if (headerObj.isDirty)
+            headerObj.writeHeader();
+    }
 }
 
 bool BTree::openFile(const char *filename)
@@ -17,32 +41,109 @@ void BTree::init(bool newDb, bool inMem)
 {
     cache.init(inMem, *this);
 
+#ifdef BTREE_TRACE
+    tracerObj.enable(TRACE_DEFAULT_EVENTS);
+#endif
+
     if (newDb || inMem)
     {
-        root = new BTreeNode(true, 1, *this);
-        headerObj.setRootIndex(headerObj.nextFree());
-        headerObj.writeHeader();
+        int rootIndex = headerObj.nextFree();
+        cache.create(true, rootIndex);
+        headerObj.setRootIndex(rootIndex);
+        cache.sync();
+        filter.reset(filter.bitsPerKey, FILTER_MIN_KEYS);
     }
     else
     {
         headerObj.deserializeHeader();
-        root = cache.get(headerObj.rootIndex);
+        publish(rootIndex(), 0, std::vector<int>());
+        cache.warmUp();
+
+        /* a filter saved with other settings, or damaged, is rebuilt from the keys */
+        int bits = filter.bitsPerKey;
+        if (bits > 0 && (headerObj.filterPage == 0 || !filter.load(pagerObj, headerObj.filterPage) ||
+                         filter.bitsPerKey != bits))
+        {
+            filter.bitsPerKey = bits;
+            rebuildFilter();
+        }
     }
 }
 
+BTreeNode *BTree::rootNode()
+{
+    int root = rootIndex();
+    return root > 0 ? cache.get(root) : nullptr;
+}
+
+int BTree::rootIndex()
+{
+    return activeTree < 0 ? headerObj.rootIndex : headerObj.catalog[activeTree].root;
+}
+
+/* the new root of the active tree, sync writes it out with the header */
+void BTree::setRoot(int index)
+{
+    if (activeTree < 0)
+        headerObj.setRootIndex(index);
+    else
+        headerObj.setTreeRoot(activeTree, index);
+}
+
 void BTree::traverse()
 {
+    flushWrites();
+    BTreeNode *root = rootNode();
     if (root != nullptr)
         root->traverse();
 }
 
 BTreeNode *BTree::search(int k)
 {
+    BTreeNode *root = rootNode();
     return (root == nullptr) ? nullptr : root->search(k);
 }
 
+/* calls fn for every key in [lo, hi] in order, until fn returns false */
+void BTree::scan(int lo, int hi, const ScanFn &fn)
+{
+    flushWrites();
+
+    OpTimer timer(statsObj, STAT_OP_SCAN);
+    TRACE_SPAN(*this, TRACE_SCAN, lo);
+
+    BTreeNode *root = rootNode();
+    if (root != nullptr)
+        root->scan(lo, hi, fn);
+}
+
 bool BTree::get(int k, char *result)
 {
+    OpTimer timer(statsObj, STAT_OP_GET);
+    TRACE_SPAN(*this, TRACE_GET, k);
+
+    if (!filter.mayContain(k))
+    {
+        statsObj.add(STAT_FILTER_SKIPS);
+        return false;
+    }
+
+    return lookup(k, result);
+}
+
+/* reads k through the write buffer, without the filter check */
+bool BTree::lookup(int k, char *result)
+{
+    auto it = pending.find(k);
+    if (it != pending.end())
+    {
+        if (it->second.remove)
+            return false;
+
+        memcpy(result, it->second.data, DATA_SIZE);
+        return true;
+    }
+
     BTreeNode *node = search(k);
     if (node == nullptr)
     {
@@ -50,72 +151,981 @@ bool BTree::get(int k, char *result)
     }
 
     int idx = node->findKey(k);
-    if (idx < node->numKeys && node->keys[idx].key == k)
+    if (idx < node->numKeys && node->keys[idx].key == k && !node->isDeleted(idx))
     {
-        strncpy(result, node->keys[idx].data, DATA_SIZE);
+        /* values are DATA_SIZE bytes, not strings, so binary values come back whole */
+        memcpy(result, node->keys[idx].data, DATA_SIZE);
         return true;
     }
 
     return false;
 }
 
+/* like get, without the copy. the view is empty if k isn't in the tree */
+ValueView BTree::getView(int k)
+{
+    OpTimer timer(statsObj, STAT_OP_GET);
+    TRACE_SPAN(*this, TRACE_GET, k);
+
+    if (!filter.mayContain(k))
+    {
+        statsObj.add(STAT_FILTER_SKIPS);
+        return ValueView();
+    }
+
+    /* the view points into a leaf, so a pending write of k goes there first */
+    if (pending.count(k) > 0)
+        flushWrites();
+
+    BTreeNode *node = search(k);
+    if (node == nullptr)
+        return ValueView();
+
+    int idx = node->findKey(k);
+    if (idx < node->numKeys && node->keys[idx].key == k && !node->isDeleted(idx))
+        return ValueView(cache, node, node->keys[idx].data);
+
+    return ValueView();
+}
+
 void BTree::insert(int k, char data[DATA_SIZE])
 {
-    if (root->numKeys == 2 * t - 1)
+    /* without a filter to keep up to date a buffered insert doesn't need to know what it replaces */
+    if (buffering() && !filter.enabled())
     {
+        OpTimer timer(statsObj, STAT_OP_INSERT);
+        TRACE_SPAN(*this, TRACE_INSERT, k);
+        enqueue(k, data, false);
+        return;
+    }
+
+    update(k, [data](char *value, bool) {
+        memcpy(value, data, DATA_SIZE);
+        return true;
+    });
+}
+
+/*
+read-modify-write of k in a single descent, see UpdateFn. returns true if fn
+stored a value. fn runs with the tree's frames pinned, it mustn't call back
+into the tree.
+*/
+bool BTree::update(int k, const UpdateFn &fn)
+{
+    OpTimer timer(statsObj, STAT_OP_INSERT);
+    TRACE_SPAN(*this, TRACE_INSERT, k);
+
+    bool found = false;
+    bool stored;
+    if (buffering())
+    {
+        /* the old value comes from the buffer or the tree, the new one waits in the buffer */
+        char value[DATA_SIZE];
+        found = filter.mayContain(k) && lookup(k, value);
+        if (!found)
+            memset(value, 0, DATA_SIZE);
+
+        stored = fn(value, found);
+        if (stored)
+            enqueue(k, value, false);
+    }
+    else if (filter.enabled())
+    {
+        stored = store(k, [&fn, &found](char *data, bool present) {
+            found = present;
+            return fn(data, present);
+        }, true);
+    }
+    else
+    {
+        stored = store(k, fn, true);
+    }
+
+    if (stored && !found && filter.enabled())
+    {
+        filter.add(k);
+        filter.keys++;
+        if (filter.isStale())
+            rebuildFilter();
+    }
+    return stored;
+}
+
+/* the descent behind update, sync false leaves the dirty pages for a later sync */
+bool BTree::store(int k, const UpdateFn &fn, bool sync)
+{
+    dropSavedFilter();
+    cache.beginOp();
+
+    /* an append goes straight to the rightmost leaf, otherwise the descent starts at the root */
+    BTreeNode *start = appendTarget(k);
+    if (start == nullptr)
+    {
+        start = rootNode();
+        start->purge();
+    }
+
+    if (start->numKeys == 2 * t - 1)
+    {
+        BTreeNode *root = start;
         cache.markDirty(root->index);
 
-        BTreeNode *s = new BTreeNode(false, headerObj.nextFree(), *this);
+        BTreeNode *s = cache.create(false, headerObj.nextFree());
         s->children[0] = root->index;
 
-        s->splitChild(0, root);
+        if (k > root->keys[root->numKeys - 1].key)
+            s->splitLast(0, root);
+        else
+            s->splitChild(0, root);
+        cache.markDirty(s->index);
+        setRoot(s->index);
+        start = s;
+    }
 
-        int i = 0;
-        if (s->keys[0].key < k)
-            i++;
+    bool stored;
+    if (changeFeed.enabled())
+    {
+        bool found = false;
+        char value[DATA_SIZE];
+        stored = start->upsert(k, [&fn, &found, &value](char *data, bool present) {
+            found = present;
+            if (!fn(data, present))
+                return false;
 
-        cache.get(s->children[i])->insertNonFull(k, data);
-        root = s;
-        cache.markDirty(root->index);
-        headerObj.setRootIndex(root->index);
-        headerObj.writeHeader();
+            memcpy(value, data, DATA_SIZE);
+            return true;
+        }, true);
+
+        if (stored)
+            noteChange(activeTree, found ? CHANGE_UPDATE : CHANGE_INSERT, k, k, value);
+    }
+    else
+    {
+        stored = start->upsert(k, fn, true);
+    }
+
+    if (sync)
+        cache.sync();
+    cache.endOp();
+    if (sync)
+        commitChanges();
+    return stored;
+}
+
+/*
+the rightmost leaf if k goes after every key in the tree and the leaf has room
+for it. copy-on-write moves pages at every commit and count builds keep counts
+in every ancestor, so both always descend from the root.
+*/
+BTreeNode *BTree::appendTarget(int k)
+{
+#ifdef BTREE_COUNTS
+    return nullptr;
+#else
+    if (rightLeaf <= 0 || cache.isCopyOnWrite())
+        return nullptr;
+
+    BTreeNode *leaf = cache.get(rightLeaf);
+    leaf->purge();
+    if (leaf->numKeys == 0 || leaf->numKeys == 2 * t - 1 || k <= leaf->keys[leaf->numKeys - 1].key)
+        return nullptr;
+    return leaf;
+#endif
+}
+
+/*
+appends leave the nodes on the right edge short of t-1 keys, and deletes need
+every node to have them. walks down the right edge refilling each short node
+from its left sibling, or merging it in, until the whole edge holds up again.
+*/
+void BTree::repairRightEdge()
+{
+    bool repaired = true;
+    while (repaired)
+    {
+        repaired = false;
+        collapseRoot();
+
+        BTreeNode *node = rootNode();
+        while (!node->isLeaf && node->numKeys > 0)
+        {
+            int last = node->numKeys;
+            BTreeNode *child = cache.get(node->children[last]);
+            if (child->numKeys - child->numDeleted < t - 1)
+            {
+                last = node->repairChild(last);
+                repaired = true;
+            }
+            node = cache.get(node->children[last]);
+        }
+    }
+
+    shortRightEdge = false;
+    rightLeaf = -1;
+}
+
+/* inserts k only if it isn't there yet, returns true if it was inserted */
+bool BTree::putIfAbsent(int k, char data[DATA_SIZE])
+{
+    return update(k, [data](char *value, bool found) {
+        if (found)
+            return false;
+
+        memcpy(value, data, DATA_SIZE);
+        return true;
+    });
+}
+
+/* replaces the value of k with data only if all DATA_SIZE bytes still equal expected */
+bool BTree::compareAndSwap(int k, const char expected[DATA_SIZE], char data[DATA_SIZE])
+{
+    return update(k, [expected, data](char *value, bool found) {
+        if (!found || memcmp(value, expected, DATA_SIZE) != 0)
+            return false;
+
+        memcpy(value, data, DATA_SIZE);
+        return true;
+    });
+}
+
+/* returns false if the key wasn't in the tree */
+bool BTree::remove(int k)
+{
+    OpTimer timer(statsObj, STAT_OP_REMOVE);
+    TRACE_SPAN(*this, TRACE_REMOVE, k);
+
+    bool found;
+    if (buffering())
+    {
+        char value[DATA_SIZE];
+        found = filter.mayContain(k) && lookup(k, value);
+        if (found)
+            enqueue(k, nullptr, true);
+    }
+    else
+    {
+        found = erase(k, true);
+    }
+
+    if (found && filter.enabled())
+    {
+        filter.removed++;
+        if (filter.isStale())
+            rebuildFilter();
+    }
+    return found;
+}
+
+/* the descent behind remove, sync false leaves the dirty pages for a later sync */
+bool BTree::erase(int k, bool sync)
+{
+    dropSavedFilter();
+    cache.beginOp();
+
+    /* merges may free the rightmost leaf */
+    rightLeaf = -1;
+    if (shortRightEdge)
+        repairRightEdge();
+    BTreeNode *root = rootNode();
+
+    if (root->numKeys == 0)
+    {
+        cache.endOp();
+        return false;
     }
+
+    bool found;
+    LazyRemove lazy = lazyDelete ? removeLazily(k) : LAZY_EAGER;
+    if (lazy == LAZY_EAGER)
+        found = root->remove(k);
     else
+        found = lazy == LAZY_MARKED;
+
+    collapseRoot();
+
+    if (found && changeFeed.enabled())
+        noteChange(activeTree, CHANGE_REMOVE, k, k, nullptr);
+
+    if (sync)
+        cache.sync();
+    cache.endOp();
+    if (sync)
+        commitChanges();
+    return found;
+}
+
+/*
+deletes every key in [lo, hi] in one pass. subtrees wholly inside the range are
+freed without their leaves being read and only the two boundary paths are
+rebalanced, so the cost follows the pages freed and the height of the tree
+rather than the number of keys.
+*/
+void BTree::removeRange(int lo, int hi)
+{
+    flushWrites();
+    if (lo > hi)
+        return;
+
+    /* the filter keeps the bits of the keys removed here until its next rebuild */
+    dropSavedFilter();
+    cache.beginOp();
+
+    rightLeaf = -1;
+    if (shortRightEdge)
+        repairRightEdge();
+    BTreeNode *root = rootNode();
+
+    int height = treeHeight(root->index);
+
+    std::vector<int> leftover;
+    root->removeRange(lo, hi, INT64_MIN, INT64_MAX, height, leftover);
+    collapseRoot();
+
+    for (int k : leftover)
     {
-        root->insertNonFull(k, data);
+        rootNode()->remove(k);
+        collapseRoot();
     }
 
+    if (changeFeed.enabled())
+        noteChange(activeTree, CHANGE_REMOVE_RANGE, lo, hi, nullptr);
+
     cache.sync();
+    cache.endOp();
+    commitChanges();
 }
 
-void BTree::remove(int k)
+/*
+empties the tree, a pass over the allocation bitmap without reading any node.
+with other trees in the file only this tree's pages are freed, which reads its
+internal nodes but still not its leaves.
+*/
+void BTree::truncate()
 {
-    if (!root)
+    pending.clear();
+    dropSavedFilter();
+    filter.clear();
+    cache.sync();
+    cache.beginOp();
+
+    bool shared = !headerObj.catalog.empty();
+    if (shared)
+        freeSubtree(rootIndex(), treeHeight(rootIndex()));
+    else
+        cache.discardAll();
+
+    int root = headerObj.nextFree();
+    cache.create(true, root);
+    setRoot(root);
+    rightLeaf = -1;
+    shortRightEdge = false;
+
+    if (changeFeed.enabled())
+        noteChange(activeTree, CHANGE_TRUNCATE, 0, 0, nullptr);
+
+    cache.sync();
+    cache.endOp();
+    commitChanges();
+
+    /* copy-on-write keeps the old pages until no snapshot needs them */
+    if (!shared && !cache.isCopyOnWrite())
+        pagerObj.truncate(root + 1);
+}
+
+bool BTree::countsAvailable()
+{
+#ifdef BTREE_COUNTS
+    return true;
+#else
+    std::cerr << "Key counts need a build with make COUNTS=1" << std::endl;
+    return false;
+#endif
+}
+
+/* number of keys in the tree, -1 without counts */
+int64_t BTree::size()
+{
+    flushWrites();
+    if (!countsAvailable())
+        return -1;
+
+    return rootNode()->subtreeCount();
+}
+
+/* number of keys less than k, so k's position if it is in the tree. -1 without counts */
+int64_t BTree::rank(int k)
+{
+    flushWrites();
+    if (!countsAvailable())
+        return -1;
+
+    int64_t below = 0;
+    BTreeNode *node = rootNode();
+
+    while (true)
     {
-        std::cout << "The tree is empty\n";
+        int i = 0;
+        for (; i < node->numKeys && node->keys[i].key < k; i++)
+        {
+            if (!node->isLeaf)
+                below += node->childCounts[i];
+            if (!node->isDeleted(i))
+                below++;
+        }
+
+        if (node->isLeaf)
+            return below;
+
+        /* everything under the child left of k is smaller */
+        if (i < node->numKeys && node->keys[i].key == k)
+            return below + node->childCounts[i];
+
+        node = cache.get(node->children[i]);
+    }
+}
+
+/* number of keys in [lo, hi], -1 without counts */
+int64_t BTree::count(int lo, int hi)
+{
+    if (lo > hi)
+        return 0;
+
+    int64_t upTo = hi == INT32_MAX ? size() : rank(hi + 1);
+    if (upTo < 0)
+        return -1;
+
+    return upTo - rank(lo);
+}
+
+/* finds the key at position i in key order, counting from 0 */
+bool BTree::select(int64_t i, int *key, char *data)
+{
+    flushWrites();
+    if (!countsAvailable() || i < 0)
+        return false;
+
+    BTreeNode *node = rootNode();
+
+    while (true)
+    {
+        BTreeNode *next = nullptr;
+
+        for (int j = 0; j <= node->numKeys; j++)
+        {
+            if (!node->isLeaf)
+            {
+                if (i < node->childCounts[j])
+                {
+                    next = cache.get(node->children[j]);
+                    break;
+                }
+                i -= node->childCounts[j];
+            }
+
+            if (j == node->numKeys || node->isDeleted(j))
+                continue;
+
+            if (i == 0)
+            {
+                *key = node->keys[j].key;
+                if (data != nullptr)
+                    memcpy(data, node->keys[j].data, DATA_SIZE);
+                return true;
+            }
+            i--;
+        }
+
+        if (next == nullptr)
+            return false;
+        node = next;
+    }
+}
+
+/*
+estimated number of keys in [lo, hi] from the top levels of the tree only.
+children the range only partly covers are read down to levels below the root,
+past that their counts are scaled by how much of their key interval the range
+covers, assuming keys are spread evenly. besides those levels it reads the two
+edge paths, for the smallest and largest key.
+*/
+double BTree::estimateCount(int lo, int hi, int levels)
+{
+    flushWrites();
+    if (!countsAvailable())
+        return -1;
+    if (lo > hi)
+        return 0;
+
+    BTreeNode *first = rootNode();
+    while (!first->isLeaf)
+        first = cache.get(first->children[0]);
+
+    BTreeNode *last = rootNode();
+    while (!last->isLeaf)
+        last = cache.get(last->children[last->numKeys]);
+
+    if (first->numKeys == 0 || last->numKeys == 0)
+        return 0;
+
+    double lower = (double)first->keys[0].key - 1;
+    double upper = (double)last->keys[last->numKeys - 1].key + 1;
+    return estimateBelow(rootNode(), lo, hi, lower, upper, levels);
+}
+
+double BTree::estimateBelow(BTreeNode *node, int lo, int hi, double lower, double upper, int levels)
+{
+    double estimate = 0;
+
+    for (int i = 0; i < node->numKeys; i++)
+    {
+        if (node->keys[i].key >= lo && node->keys[i].key <= hi && !node->isDeleted(i))
+            estimate++;
+    }
+    if (node->isLeaf)
+        return estimate;
+
+    for (int i = 0; i <= node->numKeys; i++)
+    {
+        double from = i == 0 ? lower : node->keys[i - 1].key;
+        double to = i == node->numKeys ? upper : node->keys[i].key;
+
+        double overlap = std::min(to, (double)hi + 1) - std::max(from + 1, (double)lo);
+        if (overlap <= 0)
+            continue;
+
+        if (from + 1 >= lo && to <= (double)hi + 1)
+            estimate += node->childCounts[i];
+        else if (levels > 1)
+            estimate += estimateBelow(cache.get(node->children[i]), lo, hi, from, to, levels - 1);
+        else if (to - from - 1 > 0)
+            estimate += node->childCounts[i] * std::min(1.0, overlap / (to - from - 1));
+    }
+    return estimate;
+}
+
+/* an empty leaf root stays behind as the empty tree */
+void BTree::collapseRoot()
+{
+    BTreeNode *root = rootNode();
+    while (root->numKeys == 0 && !root->isLeaf)
+    {
+        int newRoot = root->children[0];
+        cache.destroy(root);
+
+        /* if the root changes, we need to update the index the header points to, sync writes it out */
+        setRoot(newRoot);
+        cache.markDirty(newRoot);
+        root = rootNode();
+    }
+}
+
+/* levels below the root of a tree, 0 for a lone leaf */
+int BTree::treeHeight(int root)
+{
+    int height = 0;
+    for (BTreeNode *node = cache.get(root); !node->isLeaf; node = cache.get(node->children[0]))
+        height++;
+    return height;
+}
+
+/* frees a subtree height levels deep, only its internal nodes are read */
+void BTree::freeSubtree(int index, int height)
+{
+    if (height == 0)
+    {
+        cache.destroyPage(index);
         return;
     }
 
-    root->remove(k);
+    BTreeNode *node = cache.get(index);
+    std::vector<int> children(node->children, node->children + node->numKeys + 1);
+    cache.destroy(node);
 
-    if (root->numKeys == 0)
+    for (int child : children)
+        freeSubtree(child, height - 1);
+}
+
+/*
+with lazy deletes on, remove only marks keys it finds in leaves as deleted and
+leaves rebalancing to later inserts and removes that touch the leaf anyway. a
+leaf is never taken below lowWater live keys this way, which can't be less than
+t-1, past that the remove falls back to the eager path.
+*/
+void BTree::setLazyDelete(bool on, int low)
+{
+    lazyDelete = on;
+    lowWater = std::max(t - 1, std::min(low, MAX_KEYS));
+}
+
+/* marks k deleted if it sits in a leaf that can spare it, without restructuring anything */
+BTree::LazyRemove BTree::removeLazily(int k)
+{
+    BTreeNode *root = rootNode();
+    BTreeNode *node = root;
+    std::vector<std::pair<BTreeNode *, int>> path;
+
+    while (true)
     {
-        BTreeNode *tmp = root;
-        if (root->isLeaf)
-            root = nullptr;
-        else
-            root = cache.get(root->children[0]);
+        int idx = node->findKey(k);
+        if (idx < node->numKeys && node->keys[idx].key == k)
+        {
+            if (!node->isLeaf)
+                return LAZY_EAGER;
+            if (node->isDeleted(idx))
+                return LAZY_ABSENT;
+
+            /* the root has no lower bound */
+            if (node != root && node->numKeys - node->numDeleted - 1 < lowWater)
+                return LAZY_EAGER;
+
+            node->markDeleted(idx);
+            for (auto it = path.rbegin(); it != path.rend(); ++it)
+                it->first->refreshCount(it->second);
+            return LAZY_MARKED;
+        }
 
-        delete tmp;
+        if (node->isLeaf)
+            return LAZY_ABSENT;
 
-        if (root != nullptr)
+        path.push_back(std::make_pair(node, idx));
+        node = cache.get(node->children[idx]);
+    }
+}
+
+/*
+puts a bloom filter of bitsPerKey bits a key in front of get and getView, 10
+gives about 1% false positives. 0 turns it off. set it before init to load the
+filter saved at the last close, otherwise it is built with a pass over the keys.
+*/
+void BTree::setKeyFilter(int bitsPerKey)
+{
+    filter.reset(bitsPerKey, FILTER_MIN_KEYS);
+    if (bitsPerKey > 0 && rootNode() != nullptr)
+        rebuildFilter();
+}
+
+/*
+adds an empty tree called name to the file. trees share the pager, the page
+allocator and the cache, useTree picks the one the other calls work on.
+*/
+bool BTree::createTree(const char *name)
+{
+    if (name == nullptr || name[0] == '\0' || strlen(name) >= CATALOG_NAME_SIZE)
+    {
+        std::cerr << "Tree names are 1 to " << CATALOG_NAME_SIZE - 1 << " characters" << std::endl;
+        return false;
+    }
+    if (headerObj.findTree(name) >= 0)
+    {
+        std::cerr << "Tree " << name << " already exists" << std::endl;
+        return false;
+    }
+    if ((int)headerObj.catalog.size() >= MAX_TREES)
+    {
+        std::cerr << "The catalog holds at most " << MAX_TREES << " trees" << std::endl;
+        return false;
+    }
+
+    cache.beginOp();
+    int root = headerObj.nextFree();
+    cache.create(true, root);
+
+    CatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, name, CATALOG_NAME_SIZE - 1);
+    entry.root = root;
+    headerObj.catalog.push_back(entry);
+    headerObj.catalogDirty = true;
+    headerObj.isDirty = true;
+
+    cache.sync();
+    cache.endOp();
+    return true;
+}
+
+/*
+makes name the active tree, nullptr or "" for the default one. switching only
+swaps in the tree's root and its lazy delete and key filter settings, so
+interleaving updates to several trees costs nothing extra. settings last for
+the session, every open starts on the default tree.
+*/
+bool BTree::useTree(const char *name)
+{
+    flushWrites();
+    int tree = -1;
+    if (name != nullptr && name[0] != '\0')
+    {
+        tree = headerObj.findTree(name);
+        if (tree < 0)
         {
-            /* if the root changes, we need to update the index the header points to */
-            headerObj.setRootIndex(root->index);
-            cache.markDirty(root->index);
-            headerObj.writeHeader();
+            std::cerr << "No tree named " << name << std::endl;
+            return false;
         }
     }
+    if (tree == activeTree)
+        return true;
+
+    TreeOptions &parked = parkedOptions[activeTree < 0 ? "" : headerObj.catalog[activeTree].name];
+    parked.lazyDelete = lazyDelete;
+    parked.lowWater = lowWater;
+    parked.filter = std::move(filter);
+
+    activeTree = tree;
+    rightLeaf = -1;
+    shortRightEdge = true;
+
+    TreeOptions &options = parkedOptions[tree < 0 ? "" : headerObj.catalog[tree].name];
+    lazyDelete = options.lazyDelete;
+    lowWater = options.lowWater;
+    filter = std::move(options.filter);
+    options.filter = BloomFilter();
+
+    /* snapshots are of the active tree, every tree is committed between operations */
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    committedRoot = rootIndex();
+    return true;
+}
+
+/* frees every page of a named tree and removes it from the catalog */
+bool BTree::dropTree(const char *name)
+{
+    int tree = name == nullptr ? -1 : headerObj.findTree(name);
+    if (tree < 0)
+    {
+        std::cerr << "No tree named " << (name == nullptr ? "" : name) << std::endl;
+        return false;
+    }
+
+    if (tree == activeTree)
+        useTree(nullptr);
 
     cache.sync();
+    cache.beginOp();
+
+    int root = headerObj.catalog[tree].root;
+    freeSubtree(root, treeHeight(root));
+
+    if (changeFeed.enabled())
+        noteChange(tree, CHANGE_DROP_TREE, 0, 0, nullptr);
+
+    parkedOptions.erase(headerObj.catalog[tree].name);
+    headerObj.catalog.erase(headerObj.catalog.begin() + tree);
+    headerObj.catalogDirty = true;
+    headerObj.isDirty = true;
+    if (activeTree > tree)
+        activeTree--;
+
+    cache.sync();
+    cache.endOp();
+    commitChanges();
+    return true;
+}
+
+/* the names of the named trees, the default tree isn't listed */
+std::vector<std::string> BTree::trees()
+{
+    std::vector<std::string> names;
+    for (const CatalogEntry &entry : headerObj.catalog)
+        names.push_back(std::string(entry.name, strnlen(entry.name, CATALOG_NAME_SIZE)));
+    return names;
+}
+
+/*
+feeds every node and live key of the active tree to sink from threads workers,
+one per core by default. in copy-on-write mode the scan holds a snapshot, so it
+can run on another thread while the tree is written. otherwise it has to be
+called between operations on the writer's thread.
+*/
+bool BTree::parallelScan(ScanSink &sink, int threads)
+{
+    flushWrites();
+    if (cache.isInMemMode || pagerObj.fd < 0)
+    {
+        std::cerr << "Parallel scans need a database file" << std::endl;
+        return false;
+    }
+
+    std::unique_ptr<Snapshot> hold;
+    int root;
+    if (cache.isCopyOnWrite())
+    {
+        hold.reset(new Snapshot(snapshot()));
+        root = hold->rootIndex();
+    }
+    else
+    {
+        cache.sync();
+        root = rootIndex();
+    }
+
+    ParallelScan scan(*this, threads);
+    return scan.run(root, sink);
+}
+
+/*
+checks every tree in the file with a parallel scan, then that the allocated
+pages are exactly the trees' pages, the catalog, the saved key filter, the
+warm-up manifest and the retired pages snapshots may still read. problems go
+to std::cerr. call it between operations on the writer's thread.
+*/
+bool BTree::verify(int threads)
+{
+    flushWrites();
+    if (cache.isInMemMode || pagerObj.fd < 0)
+    {
+        std::cerr << "Checks need a database file" << std::endl;
+        return false;
+    }
+
+    if (!cache.isCopyOnWrite())
+        cache.sync();
+
+    std::vector<int> roots(1, headerObj.rootIndex);
+    for (const CatalogEntry &entry : headerObj.catalog)
+        roots.push_back(entry.root);
+
+    VerifySink sink(headerObj);
+    ParallelScan scan(*this, threads);
+    for (int root : roots)
+        scan.run(root, sink);
+
+    std::vector<int> reserved = cache.reservedPages();
+    if (headerObj.catalogPage > 0)
+        reserved.push_back(headerObj.catalogPage);
+    if (headerObj.filterPage > 0)
+    {
+        std::vector<int> image = BloomFilter::pages(pagerObj, headerObj.filterPage);
+        reserved.insert(reserved.end(), image.begin(), image.end());
+    }
+    sink.checkAllocation(reserved);
+
+    for (const std::string &problem : sink.problems())
+        std::cerr << problem << std::endl;
+    return sink.ok();
+}
+
+/*
+with warm-up on, the pages resident in the cache are listed in a manifest at
+close, and every intervalSyncs syncs if that is set, so a crash loses little.
+init reads the listed pages back in file order before serving anything. a
+manifest is read back even with warm-up off, but then no new one is written.
+*/
+void BTree::setWarmup(bool on, int intervalSyncs)
+{
+    warmup = on;
+    cache.setWarmupInterval(on ? intervalSyncs : 0);
+}
+
+/* refills the filter from the keys in the tree, sized for twice as many */
+void BTree::rebuildFilter()
+{
+    std::vector<int> keys;
+    scan(INT_MIN, INT_MAX, [&keys](int k, const char *) {
+        keys.push_back(k);
+        return true;
+    });
+
+    filter.reset(filter.bitsPerKey, (int64_t)keys.size() * 2);
+    for (int k : keys)
+        filter.add(k);
+    filter.keys = keys.size();
+}
+
+/* saves the filter at close, so the next init can load it instead of reading every leaf */
+void BTree::saveFilter()
+{
+    if (!filter.enabled() || cache.isInMemMode || pagerObj.fd < 0 || headerObj.rootIndex <= 0 ||
+        headerObj.filterPage != 0)
+        return;
+
+    int first = filter.save(pagerObj, headerObj);
+    if (first <= 0)
+        return;
+
+    /* the pages go down before the header points at them */
+    pagerObj.sync();
+    headerObj.filterPage = first;
+    headerObj.writeHeader();
+    pagerObj.sync();
+}
+
+/*
+a saved filter only matches the keys it was saved with. before the first change
+reaches the file its pages are freed and the header stops pointing at them, so
+a crash part way through a write can't leave a filter that is missing keys.
+*/
+void BTree::dropSavedFilter()
+{
+    if (headerObj.filterPage == 0)
+        return;
+
+    BloomFilter::release(pagerObj, headerObj, headerObj.filterPage);
+    headerObj.filterPage = 0;
+    headerObj.writeHeader();
+    pagerObj.sync();
+}
+
+/* drops every tombstone left by lazy deletes, e.g. while the tree is idle */
+void BTree::compact()
+{
+    flushWrites();
+    rootNode()->compact();
+    cache.sync();
+}
+
+/*
+called by NodeCache once a copy-on-write commit is on disk. the commit's pages
+are stamped under the same lock a backup takes its snapshot under, so each
+commit lands wholly before or after a backup checkpoint.
+*/
+void BTree::publish(int root, uint64_t version, const std::vector<int> &written)
+{
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    committedRoot = root;
+    committedVersion = version;
+    committedDefault = headerObj.rootIndex;
+    committedCatalog = headerObj.catalog;
+    stampPages(written);
+}
+
+void BTree::recordChanges(const std::vector<int> &written)
+{
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    stampPages(written);
+}
+
+/* snapshotLock must be held */
+void BTree::stampPages(const std::vector<int> &written)
+{
+    for (size_t i = 0; i < written.size(); i++)
+    {
+        if (written[i] > 0 && written[i] < MAX_PAGE_COUNT)
+            pageEpochs[written[i]] = changeEpoch;
+    }
+}
+
+Snapshot BTree::snapshot()
+{
+    if (!cache.isCopyOnWrite())
+    {
+        throw std::runtime_error("Snapshots need copy-on-write mode");
+    }
+
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    openSnapshots.insert(committedVersion);
+    return Snapshot(*this, committedRoot, committedVersion);
+}
+
+void BTree::releaseSnapshot(uint64_t version)
+{
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    auto it = openSnapshots.find(version);
+    if (it != openSnapshots.end())
+        openSnapshots.erase(it);
+}
+
+uint64_t BTree::oldestSnapshot()
+{
+    std::lock_guard<std::mutex> lock(snapshotLock);
+    return openSnapshots.empty() ? UINT64_MAX : *openSnapshots.begin();
 }
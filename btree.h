@@ -8,26 +8,115 @@
 #include <cstring>
 #include <cstdint>
 #include <unordered_map>
+#include <list>
+#include <vector>
+#include <new>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+#include <memory>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include <deque>
 
 #define PAGE_SIZE 4096
 #define NODE_HEADER_SIZE (sizeof(int) * 3)
 #define AVAILABLE_SPACE (PAGE_SIZE - NODE_HEADER_SIZE)
+/* fanout, can be overridden at build time (make MAX_KEYS=32). files are only readable by builds with the same value */
+#ifndef MAX_KEYS
 #define MAX_KEYS 10
+#endif
 #define t ((MAX_KEYS + 1) / 2)
+/* findKey scans nodes up to this many keys, larger ones are searched by interpolation */
+#ifndef FIND_LINEAR_KEYS
+#define FIND_LINEAR_KEYS 16
+#endif
 #define CHILD_PTR_SPACE ((MAX_KEYS + 1) * sizeof(int))
+/* per child key counts for rank and select, built with make COUNTS=1. files are only readable by builds with the same setting */
+#ifdef BTREE_COUNTS
+#define CHILD_COUNT_SPACE ((MAX_KEYS + 1) * sizeof(int))
+#else
+#define CHILD_COUNT_SPACE 0
+#endif
 #define KEYS_SPACE (MAX_KEYS * sizeof(int))
-#define AVAILABLE_DATA_SPACE (AVAILABLE_SPACE - KEYS_SPACE - CHILD_PTR_SPACE)
-#define DATA_SIZE (AVAILABLE_DATA_SPACE / MAX_KEYS)
+#define AVAILABLE_DATA_SPACE (AVAILABLE_SPACE - KEYS_SPACE - CHILD_PTR_SPACE - CHILD_COUNT_SPACE)
+/* rounded down so KeyValue has no padding */
+#define DATA_SIZE (AVAILABLE_DATA_SPACE / MAX_KEYS / sizeof(int) * sizeof(int))
 
+/* header page: [root][bitmap][extension], the extension is [magic][saved key filter page][warm-up manifest page][catalog page] */
 #define ROOT_INDEX_SIZE sizeof(int)
-#define BITMAP_SIZE (PAGE_SIZE - ROOT_INDEX_SIZE)
+#define HEADER_EXT_SIZE (sizeof(int) * 4)
+#define HEADER_EXT_MAGIC 0x54584548
+#define BITMAP_SIZE (PAGE_SIZE - ROOT_INDEX_SIZE - HEADER_EXT_SIZE)
 #define BITS_PER_BYTE 8
 #define MAX_PAGES (BITMAP_SIZE * BITS_PER_BYTE)
+/* MAX_PAGES is a size_t, page indexes are ints */
+static const int MAX_PAGE_COUNT = (int)MAX_PAGES;
 
 #define MAX_CACHE_SIZE 20
 
+/* leaves with deleted keys store a bitmap of them in the unused child pointer area, flagged by numChildren */
+#define LEAF_TOMBSTONES (-1)
+#define TOMBSTONE_BYTES ((MAX_KEYS + 7) / 8)
+
+/* backup files: [magic][root][base checkpoint][checkpoint][catalog] then [index][page] records up to index -1 */
+#define BACKUP_MAGIC 0x4B425443
+#define BACKUP_MAGIC_NO_CATALOG 0x4B425442
+#define BACKUP_RUN_PAGES 64
+
+/* compressed node pages: [tag][codec][payload length][payload] */
+#define COMPRESSED_PAGE_TAG (-1)
+#define COMPRESSED_HEADER_SIZE (sizeof(int) * 3)
+
+/* key filter: 512 bit blocks. a saved filter is a page of its fields and data page list, then the data pages */
+#define FILTER_BLOCK_WORDS 8
+#define FILTER_BLOCK_BITS (FILTER_BLOCK_WORDS * 64)
+#define FILTER_MIN_KEYS 4096
+#define FILTER_MAGIC 0x544C4946
+
+/* warm-up manifest pages: [magic][count][next page][count page indexes, hottest first] */
+#define WARMUP_MAGIC 0x4D524157
+#define WARMUP_HEADER_SIZE (sizeof(int) * 3)
+#define WARMUP_IDS_PER_PAGE ((int)((PAGE_SIZE - WARMUP_HEADER_SIZE) / sizeof(int)))
+#define WARMUP_RUN_PAGES 64
+#define WARMUP_MAX_GAP 8
+
+/* direct I/O scans read up to this many of the children they will visit ahead */
+#define SCAN_READAHEAD_PAGES 32
+
+/* catalog of named trees: [magic][count] then count CatalogEntry */
+#define CATALOG_MAGIC 0x474C5443
+#define CATALOG_NAME_SIZE 28
+#define CATALOG_HEADER_SIZE (sizeof(int) * 2)
+
+/* parallel scans hand each worker about this many subtrees, so workers that finish early have some to steal */
+#define SCAN_TASKS_PER_THREAD 8
+#define SCAN_MAX_DEPTH 64
+
+/* binary exports: [magic][value size] then [key][value] records in key order */
+#define EXPORT_MAGIC 0x54505845
+#define EXPORT_BUFFER_SIZE (1 << 20)
+
+#define VERIFY_MAX_PROBLEMS 100
+
+/* change log segments: [magic][value size] then ChangeEvent records, each file named for its first sequence number */
+#define CHANGE_LOG_MAGIC 0x474F4C43
+#define CHANGE_LOG_HEADER_SIZE (sizeof(int) * 2)
+#define CHANGE_SEGMENT_BYTES (64 << 20)
+#define CHANGE_KEEP_SEGMENTS 8
+#define CHANGE_RING_SIZE 1024
+
 class BTree;
 class BTreeNode;
+class Snapshot;
 class Pager;
 class Header;
 class NodeCache;
@@ -37,10 +126,10 @@ struct KeyValue
     int key;
     char data[DATA_SIZE];
 
+    /* data is left uninitialised, only the first numKeys slots of a node are ever read */
     KeyValue()
     {
         key = -1;
-        memset(data, 0, DATA_SIZE);
     }
 
     KeyValue(int k, const char *d)
@@ -61,30 +150,337 @@ struct KeyValue
     }
 };
 
+static_assert(NODE_HEADER_SIZE + sizeof(KeyValue) * MAX_KEYS + CHILD_PTR_SPACE + CHILD_COUNT_SPACE <= PAGE_SIZE,
+              "a node doesn't fit in a page");
+
+/* range scan callback, return false to stop */
+typedef std::function<bool(int key, const char *data)> ScanFn;
+
+/*
+read-modify-write callback. data is the value in its cache frame, or zeroes if
+found is false. return true to store it, or false without touching data to
+leave the tree as it was.
+*/
+typedef std::function<bool(char *data, bool found)> UpdateFn;
+
+enum ChangeType
+{
+    CHANGE_INSERT,
+    CHANGE_UPDATE,
+    CHANGE_REMOVE,
+    CHANGE_REMOVE_RANGE,
+    CHANGE_TRUNCATE,
+    CHANGE_DROP_TREE
+};
+
+/*
+a committed change to one tree, tree is "" for the default one. key and last
+are both the key, or the first and last key of a range delete. data holds the
+new value of an insert or update.
+*/
+struct ChangeEvent
+{
+    uint64_t seq;
+    int type;
+    int key;
+    int last;
+    char tree[CATALOG_NAME_SIZE];
+    char data[DATA_SIZE];
+};
+
+/* change feed callback, see BTree::subscribe */
+typedef std::function<void(const ChangeEvent &change)> ChangeFn;
+
 #define KEY_VALUE_SIZE (sizeof(KeyValue))
 #define CHILD_PTR_SIZE sizeof(int)
 
+enum PageCompression
+{
+    COMPRESSION_NONE = 0,
+    COMPRESSION_LZ = 1
+};
+
+class PageCodec
+{
+public:
+    static int compress(const char *src, int srcLen, char *dst, int dstCap);
+    static int decompress(const char *src, int srcLen, char *dst, int dstCap);
+    static int encodePage(int codec, const char *raw, char page[PAGE_SIZE]);
+    static const char *decodePage(const char *page, char scratch[PAGE_SIZE]);
+};
+
+enum StatCounter
+{
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_TIER_HITS,
+    STAT_EVICTIONS,
+    STAT_WRITEBACKS,
+    STAT_PAGES_READ,
+    STAT_PAGES_WRITTEN,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_SYNCS,
+    STAT_SPLITS,
+    STAT_MERGES,
+    STAT_FILTER_SKIPS,
+    STAT_COUNT
+};
+
+enum StatOp
+{
+    STAT_OP_GET,
+    STAT_OP_INSERT,
+    STAT_OP_REMOVE,
+    STAT_OP_SCAN,
+    STAT_OP_COUNT
+};
+
+/* counters are sharded by thread so snapshot readers don't share cache lines with the writer */
+#define STATS_SHARDS 16
+
+/* latency buckets are log linear, 2^HISTOGRAM_SUB_BITS per power of two of nanoseconds */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : counts(HISTOGRAM_BUCKETS, 0), total(0), maxNs(0) {}
+
+    void record(uint64_t ns);
+    void add(int bucket, uint64_t count);
+    void setMax(uint64_t ns) { maxNs = ns; }
+    uint64_t percentile(double q) const;
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxNs; }
+
+    static int bucketOf(uint64_t ns);
+    static uint64_t upperBound(int bucket);
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t maxNs;
+};
+
+struct StatsSnapshot
+{
+    uint64_t counters[STAT_COUNT];
+    LatencyHistogram latency[STAT_OP_COUNT];
+
+    double hitRatio() const;
+    void print(std::ostream &out) const;
+};
+
+/*
+counters and per operation latency for one tree. add() is cheap enough for the
+hot path, reads add the shards up. the latency histograms are only written by
+tree operations, which run one at a time.
+*/
+class Stats
+{
+public:
+    Stats();
+
+    Stats(const Stats &) = delete;
+    Stats &operator=(const Stats &) = delete;
+
+    void add(StatCounter counter, uint64_t n = 1)
+    {
+        shards[shardIndex()].values[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void recordLatency(StatOp op, uint64_t ns);
+    StatsSnapshot snapshot() const;
+    void setDump(std::ostream *out, int intervalMs);
+    void maybeDump(uint64_t now);
+
+    static uint64_t now();
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> values[STAT_COUNT];
+    };
+
+    Shard shards[STATS_SHARDS];
+    std::atomic<uint64_t> buckets[STAT_OP_COUNT][HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> maxLatency[STAT_OP_COUNT];
+
+    std::ostream *dumpOut;
+    uint64_t dumpIntervalNs;
+    uint64_t nextDump;
+
+    static int shardIndex();
+};
+
+/* times one tree operation, recorded when it goes out of scope */
+class OpTimer
+{
+public:
+    OpTimer(Stats &stats, StatOp op) : stats(stats), op(op), start(Stats::now()) {}
+    ~OpTimer()
+    {
+        uint64_t end = Stats::now();
+        stats.recordLatency(op, end - start);
+        stats.maybeDump(end);
+    }
+
+private:
+    Stats &stats;
+    StatOp op;
+    uint64_t start;
+};
+
+enum TraceType
+{
+    TRACE_SPLIT,
+    TRACE_MERGE,
+    TRACE_BORROW_PREV,
+    TRACE_BORROW_NEXT,
+    TRACE_EVICT,
+    TRACE_GET,
+    TRACE_INSERT,
+    TRACE_REMOVE,
+    TRACE_SCAN,
+    TRACE_TYPE_COUNT
+};
+
+#define TRACE_DEFAULT_EVENTS 65536
+
+/*
+depth is how far below the root the changed nodes are, -1 where it isn't known.
+page and arg depend on the type: the node and its new sibling for a split, the
+child and the sibling for merges and borrows, the page and whether it was dirty
+for an eviction, and the key for operation spans.
+*/
+struct TraceEvent
+{
+    uint64_t ts;
+    uint64_t dur;
+    int type;
+    int depth;
+    int page;
+    int arg;
+};
+
+/*
+lock-free ring of the most recent trace events. writers claim a slot with one
+fetch_add and publish it through the slot's sequence number, so an export
+running alongside skips slots that are mid-write instead of waiting.
+only fed when built with BTREE_TRACE (make TRACE=1), otherwise the TRACE_
+macros compile to nothing.
+*/
+class Tracer
+{
+public:
+    Tracer() : head(0), mask(0), depth(0), epoch(0) {}
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    void enable(size_t events);
+    void record(int type, int page, int arg, uint64_t start = 0, uint64_t end = 0);
+    void exportChromeTrace(std::ostream &out);
+    void clear() { head.store(0, std::memory_order_relaxed); }
+
+    void descend() { depth++; }
+    void ascend() { depth--; }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq;
+        TraceEvent event;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> head;
+    uint64_t mask;
+    int depth;
+    uint64_t epoch;
+};
+
+/* tracks how deep the current operation is, for the events it records */
+class TraceDepth
+{
+public:
+    TraceDepth(Tracer &tracer) : tracer(tracer) { tracer.descend(); }
+    ~TraceDepth() { tracer.ascend(); }
+
+private:
+    Tracer &tracer;
+};
+
+/* records a whole operation as one span */
+class TraceSpan
+{
+public:
+    TraceSpan(Tracer &tracer, int type, int key) : tracer(tracer), type(type), key(key), start(Stats::now()) {}
+    ~TraceSpan() { tracer.record(type, -1, key, start, Stats::now()); }
+
+private:
+    Tracer &tracer;
+    int type;
+    int key;
+    uint64_t start;
+};
+
+#ifdef BTREE_TRACE
+#define TRACE_EVENT(tree, type, page, arg) (tree).tracer().record(type, page, arg)
+#define TRACE_DEPTH(tree) TraceDepth traceDepth((tree).tracer())
+#define TRACE_SPAN(tree, type, key) TraceSpan traceSpan((tree).tracer(), type, key)
+#else
+#define TRACE_EVENT(tree, type, page, arg) ((void)0)
+#define TRACE_DEPTH(tree) ((void)0)
+#define TRACE_SPAN(tree, type, key) ((void)0)
+#endif
+
 class Pager
 {
 public:
-    Pager() = default;
+    Pager(Stats &stats) : fd(-1), blockSize(PAGE_SIZE), direct(false), stats(stats) {}
     ~Pager() { cleanup(); }
 
-    std::fstream file;
+    int fd;
+    int blockSize;
+
+    /* open with O_DIRECT, so the NodeCache is the only cache of the file */
+    bool direct;
+    Stats &stats;
 
     void getPage(char buffer[PAGE_SIZE], int index);
+    void readPages(char *buffer, int first, int count);
+    int pageCount();
     void writePage(int index, char *buffer);
     void writePages(int index, char *buffer);
+    void punchHole(int index, int used);
+    void prefetch(int first, int count);
     void flush();
+    void sync();
+    void truncate(int pages);
     void deleteFile();
     void cleanup();
     bool open(const char *filename);
+    bool openTemporary();
+};
+
+/* a named tree, the default tree's root stays in the header page itself */
+struct CatalogEntry
+{
+    char name[CATALOG_NAME_SIZE];
+    int root;
 };
 
+#define MAX_TREES ((int)((PAGE_SIZE - CATALOG_HEADER_SIZE) / sizeof(CatalogEntry)))
+
 class Header
 {
 public:
-    Header(Pager &pager) : pager(pager), rootIndex(0)
+    Header(Pager &pager)
+        : pager(pager), rootIndex(0), filterPage(0), warmupPage(0), catalogPage(0), catalogDirty(false), isDirty(false)
     {
         memset(bitmap, 0, BITMAP_SIZE);
     }
@@ -92,6 +488,18 @@ public:
     int rootIndex;
     uint8_t bitmap[BITMAP_SIZE];
 
+    /* first page of the key filter saved at close, 0 once the tree has changed since */
+    int filterPage;
+
+    /* first page of the cache warm-up manifest, 0 if there is none */
+    int warmupPage;
+
+    /* roots of the named trees, the catalog page is rewritten with the header when they change */
+    int catalogPage;
+    std::vector<CatalogEntry> catalog;
+    bool catalogDirty;
+    bool isDirty;
+
     void deserializeHeader();
     void serializeHeader(char buffer[PAGE_SIZE]);
     void writeHeader();
@@ -102,9 +510,50 @@ public:
     void setRootIndex(int index);
     void setBit(int index, bool value);
     bool getBit(int index);
+    void clear();
+
+    int findTree(const char *name);
+    void setTreeRoot(int tree, int index);
 
 private:
     Pager &pager;
+
+    void readCatalog();
+    void writeCatalog();
+};
+
+/*
+second tier below the NodeCache frames. holds LZ compressed images of clean
+pages evicted from the frames, sized in bytes rather than pages.
+*/
+class CompressedCache
+{
+public:
+    CompressedCache() : capacity(0), used(0) {}
+
+    void setCapacity(size_t bytes);
+    bool get(int index, char raw[PAGE_SIZE]);
+    void put(int index, const char *raw);
+    void erase(int index);
+    void clear();
+
+    bool enabled() const { return capacity > 0; }
+    size_t bytesUsed() const { return used; }
+    size_t count() const { return entries.size(); }
+
+private:
+    struct Entry
+    {
+        int index;
+        std::vector<char> image;
+    };
+
+    std::list<Entry> lru;
+    std::unordered_map<int, std::list<Entry>::iterator> entries;
+    size_t capacity;
+    size_t used;
+
+    void evictOldest();
 };
 
 class BTreeNode
@@ -112,19 +561,34 @@ class BTreeNode
 public:
     KeyValue keys[MAX_KEYS];
     int children[MAX_KEYS + 1];
+    /* live keys below each child, only kept up to date in COUNTS builds */
+    int childCounts[MAX_KEYS + 1];
     int numKeys;
     int index;
     bool isLeaf;
 
+    /* keys removed lazily, leaves only. they still count towards numKeys until purged */
+    uint8_t tombstones[TOMBSTONE_BYTES];
+    int numDeleted;
+
     BTreeNode(bool leaf, int idx, BTree &btree);
-    ~BTreeNode();
+
+    bool isDeleted(int i) const { return (tombstones[i / 8] >> (i % 8)) & 1; }
+    void markDeleted(int i);
+    bool purge();
+    void compact();
+    int subtreeCount() const;
+    void refreshCount(int i);
 
     void traverse();
+    bool scan(int lo, int hi, const ScanFn &fn);
     BTreeNode *search(int k);
     int findKey(int k);
     void insertNonFull(int k, char data[DATA_SIZE]);
+    bool upsert(int k, const UpdateFn &fn, bool rightEdge = false);
     void splitChild(int i, BTreeNode *y);
-    void remove(int k);
+    void splitLast(int i, BTreeNode *y);
+    bool remove(int k);
     void removeFromLeaf(int idx);
     void removeFromNonLeaf(int idx);
     KeyValue getPred(int idx);
@@ -133,16 +597,22 @@ public:
     void borrowFromPrev(int idx);
     void borrowFromNext(int idx);
     void merge(int idx);
+    void removeRange(int lo, int hi, long long lower, long long upper, int height, std::vector<int> &leftover);
+    int repairChild(int idx);
+    void repairChildren();
 
 private:
     BTree &btree;
+
+    bool updateAt(int i, const UpdateFn &fn);
 };
 
 class NodeCache
 {
 public:
-    NodeCache(Pager &pager, Header &header)
-        : pager(pager), header(header), btreePtr(nullptr), isInMemMode(false), lruCount(0) {}
+    NodeCache(Pager &pager, Header &header, Stats &stats)
+        : pager(pager), header(header), stats(stats), btreePtr(nullptr), isInMemMode(false) {}
+    ~NodeCache();
 
     NodeCache(const NodeCache &) = delete;
     NodeCache &operator=(const NodeCache &) = delete;
@@ -150,66 +620,628 @@ public:
     bool isInMemMode = false;
 
     void init(bool inMem, BTree &b);
-    void add(int index, struct BTreeNode *node);
-    void remove(int index);
+    void setCapacity(int frames) { capacity = frames > 0 ? frames : MAX_CACHE_SIZE; }
+    void setSpillLimit(int frames) { spillLimit = frames; }
+    void setWarmupInterval(int syncs) { warmupInterval = syncs; }
+    void setHugePages(bool on) { hugePages = on; }
+    void setNumaNode(int node) { numaNode = node; }
+    void saveWarmup();
+    void warmUp();
+    void readAhead(const int *pages, int count);
+    struct BTreeNode *create(bool leaf, int index);
+    void destroy(struct BTreeNode *node);
+    void destroyPage(int index);
+    void discardAll();
     struct BTreeNode *get(int index);
     void markDirty(int index);
+    void pin(int index);
+    void unpin(int index);
+    void beginOp();
+    void endOp();
     void sync();
 
     void setBTree(BTree *btree) { btreePtr = btree; }
+    void setCopyOnWrite(bool on) { cowMode = on; }
+    bool isCopyOnWrite() const { return cowMode; }
+    void setCompression(int c) { codec = c; }
+    void setCompressedCacheSize(size_t bytes) { compressedCache.setCapacity(bytes); }
+    CompressedCache &secondTier() { return compressedCache; }
+    int frameCount() const { return (int)cache.size(); }
+    size_t hugePageBytes() const;
+    std::vector<int> reservedPages();
+
+    static void serializeNode(BTreeNode *node, char *buffer);
+    static bool decodeNode(const char *buffer, BTreeNode *node);
 
 private:
+    /*
+    frames live in page aligned slabs allocated up front, nodes are constructed
+    in place over them. a frame is pinned while pins > 0, or while an operation
+    is running if the operation has touched it.
+    */
+    struct Slab
+    {
+        char *memory;
+        size_t bytes;
+        bool huge;
+    };
+
     typedef struct
     {
         BTreeNode *node;
+        char *memory;
         int nodeIndex;
         bool isDirty;
+        int pins;
+        unsigned opEpoch;
+        int prev;
+        int next;
     } CacheEntry;
 
-    CacheEntry cache[MAX_CACHE_SIZE];
+    std::vector<CacheEntry> cache;
+    std::vector<Slab> slabs;
+    std::vector<int> freeFrames;
     std::unordered_map<int, int> nodeIndexToCachePos;
-    int lruList[MAX_CACHE_SIZE];
-    int lruCount = 0;
+    int lruHead = -1;
+    int lruTail = -1;
+    int capacity = MAX_CACHE_SIZE;
+    unsigned opEpoch = 0;
+    bool inOp = false;
     Pager &pager;
     Header &header;
+    Stats &stats;
     BTree *btreePtr;
+    int codec = COMPRESSION_NONE;
+    CompressedCache compressedCache;
+
+    /* slabs of 2 MiB or more go in huge pages, and with numaNode >= 0 on that node's memory */
+    bool hugePages = true;
+    int numaNode = -1;
+
+    /*
+    memory mode keeps every node in a frame and finds it through pageFrames, by
+    page index, instead of the hash map. with a spill limit the least recently
+    used nodes past that many frames go to an unlinked temporary file instead
+    and are read back on demand.
+    */
+    int spillLimit = 0;
+    std::vector<int> pageFrames;
+
+    /*
+    copy-on-write state. committed pages are never written in place, the first
+    markDirty in a transaction moves the node to a fresh page and sync links the
+    copies into the tree and swaps the root in the header.
+    */
+    bool cowMode = false;
+    uint64_t commitVersion = 0;
+    std::unordered_map<int, int> remap;
+    std::unordered_map<int, int> relocatedFrom;
+    std::unordered_set<int> freshPages;
+    std::vector<std::pair<uint64_t, int>> retired;
 
-    void serializeNode(BTreeNode *node, char *buffer);
-    BTreeNode *deserializeNode(char *buffer);
-    int findInLru(int cachePos);
+    /* pages written since the last sync, handed to the BTree for backup change tracking */
+    std::vector<int> writtenPages;
+
+    /* the resident pages are listed in the manifest every warmupInterval syncs, 0 only at close */
+    int warmupInterval = 0;
+    int syncsSinceWarmup = 0;
+    std::vector<int> manifestPages;
+    std::vector<int> readManifest();
+    void releaseManifest();
+    void loadPages(std::vector<int> &wanted, bool evict, int maxGap);
+    char *runBuffer = nullptr;
+
+    int resolve(int index);
+    void relocate(int cachePos);
+    void retire(int index);
+    void reclaim(uint64_t oldestSnapshot);
+    void fixupRelocations();
+    void commit();
+
+    BTreeNode *deserializeNode(const char *buffer, char *memory);
+    void writeNode(BTreeNode *node, int nodeIndex);
+    void writeSerialized(const char *raw, int nodeIndex);
+    const char *readPage(int nodeIndex, char *page, char *scratch);
+    void addSlab(int frames);
+    void bindSlab(const Slab &slab);
+    void freeSlabs();
+    void install(int cachePos, BTreeNode *node, bool dirty);
+    void release(int cachePos);
+    bool isPinned(int cachePos);
+    void touch(int cachePos);
+    void lruUnlink(int cachePos);
+    void lruPushFront(int cachePos);
     void updateLru(int cachePos);
     int evictLruIfNeeded();
     int findFreeCacheSlot();
 };
 
+/*
+a read-only view of the tree as of one commit. only available in copy-on-write
+mode, where committed pages stay untouched until every snapshot that can
+reach them is gone. reads go straight to the file and take no locks, so a
+snapshot can be used from another thread while the tree is being written.
+*/
+class Snapshot
+{
+public:
+    Snapshot(BTree &btree, int root, uint64_t version);
+    Snapshot(Snapshot &&other);
+    ~Snapshot();
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    bool get(int k, char *result);
+    void scan(int lo, int hi, const ScanFn &fn);
+    uint64_t version() const { return ver; }
+    int rootIndex() const { return root; }
+
+private:
+    BTree *btree;
+    int root;
+    uint64_t ver;
+
+    bool readNode(int index, BTreeNode *node);
+    bool scanNode(int index, int lo, int hi, const ScanFn &fn);
+};
+
+/*
+blocked bloom filter over the keys of the tree, so most lookups of a missing key
+are answered without a descent. a key sets all its bits in one cache line sized
+block. bits can't be cleared, so keys counts every key added since the last
+rebuild, deleted or not, and the tree rebuilds the filter once that outgrows
+capacity or more than half of them have been deleted.
+*/
+class BloomFilter
+{
+public:
+    BloomFilter() : bitsPerKey(0), hashes(0), capacity(0), keys(0), removed(0) {}
+
+    int bitsPerKey;
+    int hashes;
+    int64_t capacity;
+    int64_t keys;
+    int64_t removed;
+    std::vector<uint64_t> blocks;
+
+    bool enabled() const { return bitsPerKey > 0; }
+    void reset(int bitsPerKey, int64_t capacity);
+    void clear();
+    void add(int k);
+    bool mayContain(int k) const;
+    bool isStale() const;
+
+    int save(Pager &pager, Header &header);
+    bool load(Pager &pager, int first);
+    static std::vector<int> pages(Pager &pager, int first);
+    static void release(Pager &pager, Header &header, int first);
+
+private:
+    size_t blockOf(uint64_t hash) const;
+};
+
+/*
+numbers the committed changes of every tree in the file and hands them to the
+subscribers once the sync that commits them is done. the last CHANGE_RING_SIZE
+are kept in memory. with a log open every change is also appended to its
+newest segment, which is rotated once it passes segmentBytes, keeping the
+newest keepSegments. a subscriber resumes after the last sequence number it
+saw, from the log if there is one and from the ring otherwise.
+*/
+class ChangeFeed
+{
+public:
+    ChangeFeed() : active(false), nextSeq(1), nextId(0), fd(-1), segmentBytes(0), keepSegments(0), written(0) {}
+    ~ChangeFeed() { closeLog(); }
+
+    ChangeFeed(const ChangeFeed &) = delete;
+    ChangeFeed &operator=(const ChangeFeed &) = delete;
+
+    bool enabled() const { return active; }
+    void startAt(uint64_t seq);
+    bool openLog(const char *path, int64_t segmentBytes, int keepSegments);
+    void closeLog();
+    void stage(const ChangeEvent &change);
+    void publish(bool durable);
+    int subscribe(uint64_t after, const ChangeFn &fn);
+    void unsubscribe(int id);
+    uint64_t last() const { return nextSeq - 1; }
+
+private:
+    bool active;
+    uint64_t nextSeq;
+    std::vector<ChangeEvent> staged;
+    std::deque<ChangeEvent> ring;
+    std::map<int, ChangeFn> subscribers;
+    int nextId;
+
+    std::string path;
+    int fd;
+    int64_t segmentBytes;
+    int keepSegments;
+    int64_t written;
+
+    std::vector<uint64_t> segments() const;
+    std::string segmentName(uint64_t first) const;
+    bool openSegment(uint64_t first);
+    bool recoverSegment(uint64_t first);
+    void rotate();
+    bool replayLog(uint64_t after, const ChangeFn &fn);
+};
+
+/*
+a value read in place from its node's cache frame, see BTree::getView. the
+frame stays pinned while the view lives, so reads can't evict it, but the view
+is only good until the next write to the tree. drop it before writing.
+*/
+class ValueView
+{
+public:
+    ValueView() : cache(nullptr), node(nullptr), value(nullptr) {}
+    ValueView(NodeCache &cache, BTreeNode *node, const char *value);
+    ValueView(ValueView &&other);
+    ValueView &operator=(ValueView &&other);
+    ~ValueView() { reset(); }
+
+    ValueView(const ValueView &) = delete;
+    ValueView &operator=(const ValueView &) = delete;
+
+    explicit operator bool() const { return value != nullptr; }
+    const char *data() const { return value; }
+    size_t size() const { return value != nullptr ? DATA_SIZE : 0; }
+    void reset();
+
+private:
+    NodeCache *cache;
+    BTreeNode *node;
+    const char *value;
+};
+
+/*
+receives a parallel scan, see ParallelScan. the nodes and keys of one partition
+come from one worker at a time and in key order, but partitions run at the same
+time, so a sink keeps its state per partition and puts it together in finish.
+the upper levels the tree is split at are visited first, from the calling
+thread, as partition 0.
+*/
+class ScanSink
+{
+public:
+    virtual ~ScanSink() {}
+
+    virtual bool begin(int partitions) { return true; }
+    virtual void node(int partition, const BTreeNode &node, int depth, long long lower, long long upper) {}
+    virtual void entry(int partition, const KeyValue &kv) {}
+    virtual void damaged(int partition, int index, int depth) {}
+    virtual bool finish() { return true; }
+};
+
+enum ExportFormat
+{
+    EXPORT_BINARY,
+    EXPORT_CSV
+};
+
+/*
+writes the live keys to a file in key order. each partition is buffered on its
+own and spilled to an unlinked temporary file beside the output once it
+outgrows EXPORT_BUFFER_SIZE, finish then appends them in order.
+*/
+class ExportSink : public ScanSink
+{
+public:
+    ExportSink(const char *path, ExportFormat format) : path(path), format(format), failed(false), total(0) {}
+    ~ExportSink();
+
+    bool begin(int partitions) override;
+    void entry(int partition, const KeyValue &kv) override;
+    void damaged(int partition, int index, int depth) override;
+    bool finish() override;
+
+    int64_t count() const { return total; }
+
+private:
+    struct Part
+    {
+        std::string buffer;
+        int spill = -1;
+        int64_t keys = 0;
+    };
+
+    std::string path;
+    ExportFormat format;
+    std::vector<std::unique_ptr<Part>> parts;
+    std::atomic<bool> failed;
+    int64_t total;
+
+    void flush(int partition);
+    void closeParts();
+};
+
+/*
+checks the structure of the trees it is run over: keys in order and inside
+their parent's range, t - 1 to 2t - 1 keys in every node but the root, all
+leaves at one depth, and every page allocated in the header and reached once.
+checkAllocation then looks for allocated pages no tree reached. one sink can be
+run over several trees.
+*/
+class VerifySink : public ScanSink
+{
+public:
+    VerifySink(Header &header);
+
+    bool begin(int partitions) override;
+    void node(int partition, const BTreeNode &node, int depth, long long lower, long long upper) override;
+    void entry(int partition, const KeyValue &kv) override;
+    void damaged(int partition, int index, int depth) override;
+    bool finish() override;
+    void checkAllocation(const std::vector<int> &reserved);
+
+    bool ok() const { return problemCount == 0; }
+    int64_t keys() const { return keyCount; }
+    int64_t pages() const { return pageCount; }
+    const std::vector<std::string> &problems() const { return found; }
+
+private:
+    struct Part
+    {
+        int leafDepth = -1;
+        bool haveLast = false;
+        int last = 0;
+        int64_t keys = 0;
+        int64_t pages = 0;
+    };
+
+    Header &header;
+    std::vector<std::unique_ptr<Part>> parts;
+    std::unique_ptr<std::atomic<uint8_t>[]> seen;
+    std::mutex problemLock;
+    std::vector<std::string> found;
+    int64_t problemCount;
+    int64_t keyCount;
+    int64_t pageCount;
+
+    void report(const std::string &problem);
+};
+
+/*
+walks a tree on a pool of worker threads. the upper levels are read first and
+split into about SCAN_TASKS_PER_THREAD disjoint key ranges per worker. each
+worker starts with a run of neighbouring ranges, taken from the front, and once
+they are gone steals from the back of another worker's run. workers read pages
+straight from the file into their own buffers, like a Snapshot, so the
+NodeCache is never touched.
+*/
+class ParallelScan
+{
+public:
+    ParallelScan(BTree &btree, int threads);
+
+    bool run(int root, ScanSink &sink);
+    int64_t steals() const { return stolen; }
+
+private:
+    /* a subtree, and the separator after it in key order, which its partition emits */
+    struct Task
+    {
+        int index;
+        int depth;
+        long long lower;
+        long long upper;
+        bool hasNext;
+        KeyValue next;
+    };
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<int> tasks;
+        std::vector<std::unique_ptr<BTreeNode>> nodes;
+        char page[PAGE_SIZE];
+        char scratch[PAGE_SIZE];
+    };
+
+    struct UpperNode
+    {
+        Task task;
+        std::unique_ptr<BTreeNode> node;
+    };
+
+    BTree &btree;
+    int threads;
+    ScanSink *sink;
+    std::vector<Task> tasks;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int64_t> stolen;
+
+    void split(int root, std::vector<UpperNode> &upper);
+    void work(int id);
+    bool take(int id, int *task);
+    void walk(Worker &worker, int partition, int index, int depth, long long lower, long long upper);
+    bool readNode(Worker &worker, int index, BTreeNode *node);
+};
+
 class BTree
 {
 public:
     BTree();
-    ~BTree() = default;
+    ~BTree();
 
     BTree(const BTree &) = delete;
     BTree &operator=(const BTree &) = delete;
 
     friend class BTreeNode;
     friend class NodeCache;
+    friend class Snapshot;
 
     void traverse();
+    void scan(int lo, int hi, const ScanFn &fn);
     BTreeNode *search(int k);
     void insert(int k, char data[DATA_SIZE]);
-    void remove(int k);
+    bool update(int k, const UpdateFn &fn);
+    bool putIfAbsent(int k, char data[DATA_SIZE]);
+    bool compareAndSwap(int k, const char expected[DATA_SIZE], char data[DATA_SIZE]);
+    bool remove(int k);
+    void removeRange(int lo, int hi);
+    void truncate();
+    int64_t size();
+    int64_t rank(int k);
+    int64_t count(int lo, int hi);
+    bool select(int64_t i, int *key, char *data = nullptr);
+    double estimateCount(int lo, int hi, int levels = 1);
     void init(bool newDb, bool inMem);
     bool get(int k, char *result);
+    ValueView getView(int k);
 
     bool openFile(const char *filename);
+    void setCacheSize(int frames) { cache.setCapacity(frames); }
+    /* memory mode only, spill the coldest nodes past this many frames to a temporary file. 0 keeps them all */
+    void setMemoryLimit(int frames) { cache.setSpillLimit(frames); }
+    void setCopyOnWrite(bool on) { cache.setCopyOnWrite(on); }
+    /* before openFile */
+    void setDirectIO(bool on) { pagerObj.direct = on; }
+    /* before init. huge pages are on by default, the NUMA node is the one the tree's threads run on */
+    void setHugePages(bool on) { cache.setHugePages(on); }
+    void setNumaNode(int node) { cache.setNumaNode(node); }
+    void setLazyDelete(bool on, int lowWater = t - 1);
+    void setKeyFilter(int bitsPerKey);
+    void setWarmup(bool on, int intervalSyncs = 0);
+    void setWriteBuffer(int messages);
+    void flushWrites();
+    bool openChangeLog(const char *path, int64_t segmentBytes = CHANGE_SEGMENT_BYTES,
+                       int keepSegments = CHANGE_KEEP_SEGMENTS);
+    int subscribe(uint64_t after, const ChangeFn &fn);
+    void unsubscribe(int id) { changeFeed.unsubscribe(id); }
+    uint64_t lastChange() const { return changeFeed.last(); }
+    bool createTree(const char *name);
+    bool useTree(const char *name);
+    bool dropTree(const char *name);
+    std::vector<std::string> trees();
+    bool parallelScan(ScanSink &sink, int threads = 0);
+    bool verify(int threads = 0);
+    void compact();
+    Snapshot snapshot();
+    StatsSnapshot stats() const { return statsObj.snapshot(); }
+    inline Tracer &tracer() { return tracerObj; }
+    void setStatsDump(std::ostream *out, int intervalMs) { statsObj.setDump(out, intervalMs); }
+    uint64_t backup(const char *path, uint64_t sinceCheckpoint = 0);
+    bool restoreBackup(const char *filename, const std::vector<std::string> &backups);
+    void setCompression(int codec) { cache.setCompression(codec); }
+    void setCompressedCacheSize(size_t bytes) { cache.setCompressedCacheSize(bytes); }
 
     inline NodeCache &nodeCache() { return cache; }
     inline Header &header() { return headerObj; }
     inline Pager &pager() { return pagerObj; }
 
+    /* the root is looked up through the cache every time, its frame may have been reused */
+    BTreeNode *rootNode();
+    int rootIndex();
+
 private:
-    BTreeNode *root;
+    Stats statsObj;
+    Tracer tracerObj;
     Pager pagerObj;
     Header headerObj;
     NodeCache cache;
+
+    std::mutex snapshotLock;
+    std::multiset<uint64_t> openSnapshots;
+    int committedRoot = 0;
+    uint64_t committedVersion = 0;
+
+    /* what a backup running beside the writer records, the default root and the catalog as committed */
+    int committedDefault = 0;
+    std::vector<CatalogEntry> committedCatalog;
+
+    /* which backup epoch each page was last written in, for incremental backups */
+    std::vector<uint32_t> pageEpochs;
+    uint32_t changeEpoch = 1;
+    uint32_t sessionId;
+
+    /* lazy deletes leave tombstones in leaves until a leaf would drop below lowWater live keys */
+    bool lazyDelete = false;
+    int lowWater = t - 1;
+
+    enum LazyRemove
+    {
+        LAZY_ABSENT,
+        LAZY_MARKED,
+        LAZY_EAGER
+    };
+    LazyRemove removeLazily(int k);
+
+    /* list the cached pages at close so the next init can read them back */
+    bool warmup = false;
+
+    /*
+    appends past the largest key go straight to rightLeaf, the rightmost leaf,
+    while it has room. full nodes on the right edge split at their end under
+    appends, so the nodes left behind stay full and the right edge can be left
+    short of t-1 keys. removes put it right first.
+    */
+    int rightLeaf = -1;
+    bool shortRightEdge = true;
+    BTreeNode *appendTarget(int k);
+    void repairRightEdge();
+
+    /*
+    with a write buffer, inserts and removes of the active tree are held in
+    memory in key order and applied once bufferLimit are pending, so a leaf
+    several of them land in is written once. gets read through them, anything
+    else flushes them first.
+    */
+    struct Message
+    {
+        bool remove;
+        char data[DATA_SIZE];
+    };
+    std::map<int, Message> pending;
+    int bufferLimit = 0;
+    bool buffering() { return bufferLimit > 0 && !cache.isCopyOnWrite(); }
+    void enqueue(int k, const char *data, bool remove);
+    bool lookup(int k, char *result);
+    bool store(int k, const UpdateFn &fn, bool sync);
+    bool erase(int k, bool sync);
+
+    /* changes are staged by the operation that makes them and published after its sync */
+    ChangeFeed changeFeed;
+    void noteChange(int tree, ChangeType type, int key, int last, const char *data);
+    void commitChanges() { changeFeed.publish(cache.isCopyOnWrite()); }
+
+    /*
+    the tree the other calls work on, -1 for the default tree or an index into
+    the header's catalog. every tree keeps its own options, the inactive trees'
+    are parked here by name, "" for the default tree.
+    */
+    int activeTree = -1;
+
+    struct TreeOptions
+    {
+        bool lazyDelete = false;
+        int lowWater = t - 1;
+        BloomFilter filter;
+    };
+    std::unordered_map<std::string, TreeOptions> parkedOptions;
+
+    void setRoot(int index);
+    int treeHeight(int root);
+
+    /* optional membership filter in front of get, saved at close and loaded by init */
+    BloomFilter filter;
+    void rebuildFilter();
+    void saveFilter();
+    void dropSavedFilter();
+
+    void collapseRoot();
+    bool countsAvailable();
+    double estimateBelow(BTreeNode *node, int lo, int hi, double lower, double upper, int levels);
+    void freeSubtree(int index, int height);
+
+    void publish(int root, uint64_t version, const std::vector<int> &written);
+    void recordChanges(const std::vector<int> &written);
+    void stampPages(const std::vector<int> &written);
+    bool markReachable(int index);
+    void releaseSnapshot(uint64_t version);
+    uint64_t oldestSnapshot();
 };
\ No newline at end of file
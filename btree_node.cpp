@@ -1,39 +1,184 @@
 #include "btree.h"
 
+/* nodes are constructed in place over NodeCache frames, see NodeCache::create */
 BTreeNode::BTreeNode(bool leaf, int idx, BTree &tree)
-    : btree(tree), isLeaf(leaf), index(idx), numKeys(0)
+    : btree(tree), isLeaf(leaf), index(idx), numKeys(0), numDeleted(0)
 {
+    for (int i = 0; i <= MAX_KEYS; i++)
+    {
+        children[i] = -1;
+        childCounts[i] = 0;
+    }
+    memset(tombstones, 0, TOMBSTONE_BYTES);
+}
 
-    for (int i = 0; i < MAX_KEYS; i++)
+int BTreeNode::subtreeCount() const
+{
+    int count = numKeys - numDeleted;
+    if (!isLeaf)
     {
-        keys[i] = KeyValue();
+        for (int i = 0; i <= numKeys; i++)
+            count += childCounts[i];
     }
+    return count;
+}
 
-    for (int i = 0; i <= MAX_KEYS; i++)
+/*
+called after a child's subtree gained or lost keys. only COUNTS builds keep
+counts, elsewhere it would dirty every node on the path for nothing.
+*/
+void BTreeNode::refreshCount(int i)
+{
+#ifdef BTREE_COUNTS
+    int count = btree.nodeCache().get(children[i])->subtreeCount();
+    if (childCounts[i] != count)
     {
-        children[i] = -1;
+        childCounts[i] = count;
+        btree.nodeCache().markDirty(index);
     }
+#else
+    (void)i;
+#endif
+}
 
-    btree.nodeCache().add(index, this);
+void BTreeNode::markDeleted(int i)
+{
+    tombstones[i / 8] |= 1 << (i % 8);
+    numDeleted++;
     btree.nodeCache().markDirty(index);
 }
 
-BTreeNode::~BTreeNode()
+/*
+drops the tombstoned keys of a leaf. lazy deletes stop at lowWater live keys,
+so a purged leaf still holds at least t-1 keys. anything that moves keys in or
+out of a leaf purges it first, the rest of the algorithm never sees tombstones.
+*/
+bool BTreeNode::purge()
 {
-    btree.nodeCache().remove(index);
-    btree.header().freeIndex(index);
+    if (numDeleted == 0)
+        return false;
+
+    int n = 0;
+    for (int i = 0; i < numKeys; i++)
+    {
+        if (!isDeleted(i))
+            keys[n++] = keys[i];
+    }
+
+    numKeys = n;
+    numDeleted = 0;
+    memset(tombstones, 0, TOMBSTONE_BYTES);
+    btree.nodeCache().markDirty(index);
+    return true;
+}
+
+/*
+purges every leaf below this node. the leaves under one parent are purged and
+committed as one operation, so copy-on-write finds the path still pinned.
+*/
+void BTreeNode::compact()
+{
+    if (isLeaf)
+    {
+        purge();
+        return;
+    }
+
+    NodeCache &cache = btree.nodeCache();
+    cache.pin(index);
+
+    if (cache.get(children[0])->isLeaf)
+    {
+        cache.beginOp();
+
+        bool purged = false;
+        for (int i = 0; i <= numKeys; i++)
+            purged = cache.get(children[i])->purge() || purged;
+
+        if (purged)
+            cache.sync();
+        cache.endOp();
+    }
+    else
+    {
+        for (int i = 0; i <= numKeys; i++)
+            cache.get(children[i])->compact();
+    }
+
+    cache.unpin(index);
 }
 
+/*
+index of the first key >= k. small nodes are scanned. larger ones guess the
+slot from the first and last key, which is exact for dense ids, then gallop
+out from the guess and binary search what's left, so badly spread keys still
+take O(log n) probes.
+*/
 int BTreeNode::findKey(int k)
 {
-    int idx = 0;
-    while (idx < numKeys && keys[idx].key < k)
-        ++idx;
-    return idx;
+    if (numKeys <= FIND_LINEAR_KEYS)
+    {
+        int idx = 0;
+        while (idx < numKeys && keys[idx].key < k)
+            ++idx;
+        return idx;
+    }
+
+    long long first = keys[0].key;
+    long long last = keys[numKeys - 1].key;
+    if (k <= first)
+        return 0;
+    if (k > last)
+        return numKeys;
+
+    /* keys[below] < k <= keys[above] */
+    int below = 0;
+    int above = numKeys - 1;
+    int guess = (int)((k - first) * (numKeys - 1) / (last - first));
+
+    int step = 1;
+    if (keys[guess].key < k)
+    {
+        below = guess;
+        while (below + step < above && keys[below + step].key < k)
+        {
+            below += step;
+            step *= 2;
+        }
+        if (below + step < above)
+            above = below + step;
+    }
+    else
+    {
+        above = guess;
+        while (above - step > below && keys[above - step].key >= k)
+        {
+            above -= step;
+            step *= 2;
+        }
+        if (above - step > below)
+            below = above - step;
+    }
+
+    while (above - below > 1)
+    {
+        int mid = below + (above - below) / 2;
+        if (keys[mid].key < k)
+            below = mid;
+        else
+            above = mid;
+    }
+    return above;
 }
 
-void BTreeNode::remove(int k)
+/* returns false if the key isn't in the subtree */
+bool BTreeNode::remove(int k)
 {
+    TRACE_DEPTH(btree);
+
+    if (isLeaf)
+        purge();
+
     int idx = findKey(k);
 
     if (idx < numKeys && keys[idx].key == k)
@@ -47,21 +192,24 @@ void BTreeNode::remove(int k)
     {
         if (isLeaf)
         {
-            std::cout << "The key " << k << " is does not exist in the tree\n";
-            return;
+            return false;
         }
 
         bool flag = ((idx == numKeys) ? true : false);
 
-        if (btree.nodeCache().get(children[idx])->numKeys < t)
+        BTreeNode *child = btree.nodeCache().get(children[idx]);
+        child->purge();
+        if (child->numKeys < t)
             fill(idx);
 
         if (flag && idx > numKeys)
-            btree.nodeCache().get(children[idx - 1])->remove(k);
-        else
-            btree.nodeCache().get(children[idx])->remove(k);
+            idx--;
+
+        bool found = btree.nodeCache().get(children[idx])->remove(k);
+        refreshCount(idx);
+        return found;
     }
-    return;
+    return true;
 }
 
 void BTreeNode::removeFromLeaf(int idx)
@@ -78,23 +226,30 @@ void BTreeNode::removeFromNonLeaf(int idx)
 {
     int k = keys[idx].key;
 
+    btree.nodeCache().get(children[idx])->purge();
+    btree.nodeCache().get(children[idx + 1])->purge();
+
     if (btree.nodeCache().get(children[idx])->numKeys >= t)
     {
         KeyValue pred = getPred(idx);
         keys[idx] = pred;
         btree.nodeCache().markDirty(index);
         btree.nodeCache().get(children[idx])->remove(pred.key);
+        refreshCount(idx);
     }
     else if (btree.nodeCache().get(children[idx + 1])->numKeys >= t)
     {
         KeyValue succ = getSucc(idx);
         keys[idx] = succ;
+        btree.nodeCache().markDirty(index);
         btree.nodeCache().get(children[idx + 1])->remove(succ.key);
+        refreshCount(idx + 1);
     }
     else
     {
         merge(idx);
         btree.nodeCache().get(children[idx])->remove(k);
+        refreshCount(idx);
     }
     return;
 }
@@ -105,6 +260,7 @@ KeyValue BTreeNode::getPred(int idx)
     while (!cur->isLeaf)
         cur = btree.nodeCache().get(cur->children[cur->numKeys]);
 
+    cur->purge();
     return cur->keys[cur->numKeys - 1];
 }
 
@@ -114,11 +270,18 @@ KeyValue BTreeNode::getSucc(int idx)
     while (!cur->isLeaf)
         cur = btree.nodeCache().get(cur->children[0]);
 
+    cur->purge();
     return cur->keys[0];
 }
 
 void BTreeNode::fill(int idx)
 {
+    /* sibling counts have to be live keys before choosing between a borrow and a merge */
+    if (idx != 0)
+        btree.nodeCache().get(children[idx - 1])->purge();
+    if (idx != numKeys)
+        btree.nodeCache().get(children[idx + 1])->purge();
+
     if (idx != 0 && btree.nodeCache().get(children[idx - 1])->numKeys >= t)
         borrowFromPrev(idx);
     else if (idx != numKeys && btree.nodeCache().get(children[idx + 1])->numKeys >= t)
@@ -144,23 +307,33 @@ void BTreeNode::borrowFromPrev(int idx)
     if (!child->isLeaf)
     {
         for (int i = child->numKeys; i >= 0; --i)
+        {
             child->children[i + 1] = child->children[i];
+            child->childCounts[i + 1] = child->childCounts[i];
+        }
     }
 
     child->keys[0] = keys[idx - 1];
 
     if (!child->isLeaf)
+    {
         child->children[0] = sibling->children[sibling->numKeys];
+        child->childCounts[0] = sibling->childCounts[sibling->numKeys];
+    }
 
     keys[idx - 1] = sibling->keys[sibling->numKeys - 1];
 
     child->numKeys += 1;
     sibling->numKeys -= 1;
+    childCounts[idx] = child->subtreeCount();
+    childCounts[idx - 1] = sibling->subtreeCount();
 
     btree.nodeCache().markDirty(index);
     btree.nodeCache().markDirty(child->index);
     btree.nodeCache().markDirty(sibling->index);
 
+    TRACE_EVENT(btree, TRACE_BORROW_PREV, child->index, sibling->index);
+
     return;
 }
 
@@ -172,7 +345,10 @@ void BTreeNode::borrowFromNext(int idx)
     child->keys[(child->numKeys)] = keys[idx];
 
     if (!(child->isLeaf))
+    {
         child->children[(child->numKeys) + 1] = sibling->children[0];
+        child->childCounts[(child->numKeys) + 1] = sibling->childCounts[0];
+    }
 
     keys[idx] = sibling->keys[0];
 
@@ -182,103 +358,150 @@ void BTreeNode::borrowFromNext(int idx)
     if (!sibling->isLeaf)
     {
         for (int i = 1; i <= sibling->numKeys; ++i)
+        {
             sibling->children[i - 1] = sibling->children[i];
+            sibling->childCounts[i - 1] = sibling->childCounts[i];
+        }
     }
 
     child->numKeys += 1;
     sibling->numKeys -= 1;
+    childCounts[idx] = child->subtreeCount();
+    childCounts[idx + 1] = sibling->subtreeCount();
 
     btree.nodeCache().markDirty(index);
     btree.nodeCache().markDirty(child->index);
     btree.nodeCache().markDirty(sibling->index);
 
+    TRACE_EVENT(btree, TRACE_BORROW_NEXT, child->index, sibling->index);
+
     return;
 }
 
 void BTreeNode::merge(int idx)
 {
+    btree.statsObj.add(STAT_MERGES);
+
     BTreeNode *child = btree.nodeCache().get(children[idx]);
     BTreeNode *sibling = btree.nodeCache().get(children[idx + 1]);
 
-    child->keys[t - 1] = keys[idx];
+    /* child holds t-1 keys unless a range delete left it short */
+    int n = child->numKeys;
+    child->keys[n] = keys[idx];
 
     for (int i = 0; i < sibling->numKeys; ++i)
-        child->keys[i + t] = sibling->keys[i];
+        child->keys[n + 1 + i] = sibling->keys[i];
 
     if (!child->isLeaf)
     {
         for (int i = 0; i <= sibling->numKeys; ++i)
-            child->children[i + t] = sibling->children[i];
+        {
+            child->children[n + 1 + i] = sibling->children[i];
+            child->childCounts[n + 1 + i] = sibling->childCounts[i];
+        }
     }
 
     for (int i = idx + 1; i < numKeys; ++i)
         keys[i - 1] = keys[i];
 
     for (int i = idx + 2; i <= numKeys; ++i)
+    {
         children[i - 1] = children[i];
+        childCounts[i - 1] = childCounts[i];
+    }
 
     child->numKeys += sibling->numKeys + 1;
     numKeys--;
+    childCounts[idx] = child->subtreeCount();
 
     btree.nodeCache().markDirty(index);
     btree.nodeCache().markDirty(child->index);
 
-    delete sibling;
+    TRACE_EVENT(btree, TRACE_MERGE, child->index, sibling->index);
+
+    btree.nodeCache().destroy(sibling);
 }
 
 void BTreeNode::insertNonFull(int k, char data[DATA_SIZE])
 {
+    upsert(k, [data](char *value, bool) {
+        memcpy(value, data, DATA_SIZE);
+        return true;
+    });
+}
+
+/*
+finds or inserts k in one descent from a node that isn't full, splitting full
+children on the way down like an insert. fn sees the value in place wherever
+the key lives, internal nodes included, so a key is never stored twice.
+rightEdge is set while the descent follows the tree's last children.
+*/
+bool BTreeNode::upsert(int k, const UpdateFn &fn, bool rightEdge)
+{
+    TRACE_DEPTH(btree);
+
+    if (isLeaf)
+        purge();
+
+    int i = findKey(k);
+    if (i < numKeys && keys[i].key == k)
+        return updateAt(i, fn);
+
     if (isLeaf == true)
     {
-        int existingPos = -1;
-        for (int j = 0; j < numKeys; j++)
-        {
-            if (keys[j].key == k)
-            {
-                existingPos = j;
-                break;
-            }
-        }
+        char value[DATA_SIZE];
+        memset(value, 0, DATA_SIZE);
+        if (!fn(value, false))
+            return false;
 
-        if (existingPos != -1)
-        {
-            memcpy(keys[existingPos].data, data, DATA_SIZE);
-            btree.nodeCache().markDirty(index);
-            return;
-        }
+        for (int j = numKeys - 1; j >= i; j--)
+            keys[j + 1] = keys[j];
 
-        int i = numKeys - 1;
-        while (i >= 0 && keys[i].key > k)
-        {
-            keys[i + 1] = keys[i];
-            i--;
-        }
-
-        keys[i + 1].key = k;
-        memcpy(keys[i + 1].data, data, DATA_SIZE);
+        keys[i].key = k;
+        memcpy(keys[i].data, value, DATA_SIZE);
         numKeys++;
         btree.nodeCache().markDirty(index);
+
+        if (rightEdge)
+            btree.rightLeaf = index;
+        return true;
     }
-    else
-    {
-        int i = numKeys - 1;
-        while (i >= 0 && keys[i].key > k)
-            i--;
 
-        if (btree.nodeCache().get(children[i + 1])->numKeys == 2 * t - 1)
-        {
-            splitChild(i + 1, btree.nodeCache().get(children[i + 1]));
+    /* a full leaf may only be full of tombstones */
+    BTreeNode *child = btree.nodeCache().get(children[i]);
+    child->purge();
+    if (child->numKeys == 2 * t - 1)
+    {
+        if (rightEdge && i == numKeys && k > child->keys[child->numKeys - 1].key)
+            splitLast(i, child);
+        else
+            splitChild(i, child);
 
-            if (keys[i + 1].key < k)
-                i++;
-        }
-        btree.nodeCache().get(children[i + 1])->insertNonFull(k, data);
+        if (keys[i].key == k)
+            return updateAt(i, fn);
+        if (keys[i].key < k)
+            i++;
     }
+    bool stored = btree.nodeCache().get(children[i])->upsert(k, fn, rightEdge && i == numKeys);
+    if (stored)
+        refreshCount(i);
+    return stored;
+}
+
+bool BTreeNode::updateAt(int i, const UpdateFn &fn)
+{
+    if (!fn(keys[i].data, true))
+        return false;
+
+    btree.nodeCache().markDirty(index);
+    return true;
 }
 
 void BTreeNode::splitChild(int i, BTreeNode *y)
 {
-    BTreeNode *z = new BTreeNode(y->isLeaf, btree.header().nextFree(), btree);
+    btree.statsObj.add(STAT_SPLITS);
+
+    BTreeNode *z = btree.nodeCache().create(y->isLeaf, btree.header().nextFree());
     z->numKeys = t - 1;
 
     for (int j = 0; j < t - 1; j++)
@@ -287,15 +510,27 @@ void BTreeNode::splitChild(int i, BTreeNode *y)
     if (y->isLeaf == false)
     {
         for (int j = 0; j < t; j++)
+        {
             z->children[j] = y->children[j + t];
+            z->childCounts[j] = y->childCounts[j + t];
+        }
     }
 
     y->numKeys = t - 1;
 
+    /* the upper half is the rightmost leaf now, the descent records it if it goes there */
+    if (y->index == btree.rightLeaf)
+        btree.rightLeaf = -1;
+
     for (int j = numKeys; j >= i + 1; j--)
+    {
         children[j + 1] = children[j];
+        childCounts[j + 1] = childCounts[j];
+    }
 
     children[i + 1] = z->index;
+    childCounts[i] = y->subtreeCount();
+    childCounts[i + 1] = z->subtreeCount();
 
     for (int j = numKeys - 1; j >= i; j--)
         keys[j + 1] = keys[j];
@@ -307,33 +542,266 @@ void BTreeNode::splitChild(int i, BTreeNode *y)
     btree.nodeCache().markDirty(index);
     btree.nodeCache().markDirty(y->index);
     btree.nodeCache().markDirty(z->index);
+
+    TRACE_EVENT(btree, TRACE_SPLIT, y->index, z->index);
+}
+
+/*
+splits the full last child y for an append: only y's last key moves up, and
+the new node z to its right starts out empty, an internal one with y's last
+child. y stays full, z is filled by the appends that follow.
+*/
+void BTreeNode::splitLast(int i, BTreeNode *y)
+{
+    btree.statsObj.add(STAT_SPLITS);
+
+    BTreeNode *z = btree.nodeCache().create(y->isLeaf, btree.header().nextFree());
+    z->numKeys = 0;
+
+    if (y->isLeaf == false)
+    {
+        z->children[0] = y->children[y->numKeys];
+        z->childCounts[0] = y->childCounts[y->numKeys];
+    }
+
+    y->numKeys--;
+
+    /* z is the rightmost leaf now, an append that declines to store mustn't leave y recorded */
+    if (y->index == btree.rightLeaf)
+        btree.rightLeaf = -1;
+
+    children[i + 1] = z->index;
+    childCounts[i] = y->subtreeCount();
+    childCounts[i + 1] = z->subtreeCount();
+
+    keys[i] = y->keys[y->numKeys];
+    numKeys = numKeys + 1;
+    btree.shortRightEdge = true;
+
+    btree.nodeCache().markDirty(index);
+    btree.nodeCache().markDirty(y->index);
+    btree.nodeCache().markDirty(z->index);
+
+    TRACE_EVENT(btree, TRACE_SPLIT, y->index, z->index);
 }
 
 void BTreeNode::traverse()
 {
+    /* this node is used again after each child, keep its frame from being reused */
+    btree.nodeCache().pin(index);
+
     int i;
     for (i = 0; i < numKeys; i++)
     {
         if (isLeaf == false)
             btree.nodeCache().get(children[i])->traverse();
-        std::cout << keys[i].key << " " << keys[i].data << "\n";
+        if (numDeleted == 0 || !isDeleted(i))
+            std::cout << keys[i].key << " " << keys[i].data << "\n";
     }
 
     if (isLeaf == false)
         btree.nodeCache().get(children[i])->traverse();
+
+    btree.nodeCache().unpin(index);
+}
+
+/* in order walk of the keys in [lo, hi], skipping subtrees outside the range */
+bool BTreeNode::scan(int lo, int hi, const ScanFn &fn)
+{
+    btree.nodeCache().pin(index);
+
+    int i = findKey(lo);
+
+    /*
+    in direct I/O mode the children the range covers are read in ahead of the
+    walk. fn can stop the scan at any point, so nothing is read ahead until the
+    walk leaves its first child, and the window then doubles each time the walk
+    catches up with it.
+    */
+    int last = i;
+    while (!isLeaf && last < numKeys && keys[last].key <= hi)
+        last++;
+    int readUpTo = i + 1;
+    int window = 2;
+
+    bool more = true;
+    for (; more && i <= numKeys; i++)
+    {
+        if (!isLeaf && i == readUpTo && i < last)
+        {
+            int count = std::min(window, last - i + 1);
+            btree.nodeCache().readAhead(children + i, count);
+            readUpTo = i + count;
+            window = std::min(window * 2, SCAN_READAHEAD_PAGES);
+        }
+
+        if (isLeaf == false)
+            more = btree.nodeCache().get(children[i])->scan(lo, hi, fn);
+
+        if (!more || i == numKeys || keys[i].key > hi)
+            break;
+
+        if (numDeleted == 0 || !isDeleted(i))
+            more = fn(keys[i].key, keys[i].data);
+    }
+
+    btree.nodeCache().unpin(index);
+    return more;
 }
 
 BTreeNode *BTreeNode::search(int k)
 {
-    int i = 0;
-    while (i < numKeys && k > keys[i].key)
-        i++;
+    int i = findKey(k);
 
-    if (keys[i].key == k)
+    if (i < numKeys && keys[i].key == k)
         return this;
 
     if (isLeaf == true)
         return NULL;
 
     return btree.nodeCache().get(children[i])->search(k);
-}
\ No newline at end of file
+}
+/*
+deletes every key in [lo, hi] from this subtree, whose keys all lie strictly
+between lower and upper. children wholly inside the range are freed without
+their leaves being read, only the two boundary paths are changed, and short
+nodes on them are repaired on the way back up. this node may be left short
+itself, its parent repairs it.
+
+when both boundary children survive, the key between them stays behind as
+their separator and is passed back in leftover for an ordinary remove.
+*/
+void BTreeNode::removeRange(int lo, int hi, long long lower, long long upper, int height, std::vector<int> &leftover)
+{
+    NodeCache &cache = btree.nodeCache();
+    purge();
+
+    int a = findKey(lo);
+    int b = a;
+    while (b < numKeys && keys[b].key <= hi)
+        b++;
+
+    if (isLeaf)
+    {
+        if (b > a)
+        {
+            for (int i = b; i < numKeys; i++)
+                keys[i - (b - a)] = keys[i];
+
+            numKeys -= b - a;
+            cache.markDirty(index);
+        }
+        return;
+    }
+
+    /* child i holds the keys strictly between bound(i - 1) and bound(i) */
+    auto bound = [&](int i) { return i < 0 ? lower : (i == numKeys ? upper : (long long)keys[i].key); };
+    auto overlaps = [&](int i) { return std::max((long long)lo, bound(i - 1) + 1) <= std::min((long long)hi, bound(i) - 1); };
+    auto inside = [&](int i) { return lo <= bound(i - 1) + 1 && bound(i) - 1 <= hi; };
+
+    /* children to recurse into, by their slot once the cut is made */
+    struct Boundary
+    {
+        int slot;
+        long long lower, upper;
+    };
+    std::vector<Boundary> partial;
+    int keyFrom = a, childFrom = a + 1, cut = b - a;
+
+    if (a == b)
+    {
+        if (overlaps(a))
+            partial.push_back({a, bound(a - 1), bound(a)});
+    }
+    else if (inside(b))
+    {
+        partial.push_back({a, bound(a - 1), bound(a)});
+    }
+    else if (inside(a))
+    {
+        childFrom = a;
+        partial.push_back({a, bound(b - 1), bound(b)});
+    }
+    else
+    {
+        leftover.push_back(keys[a].key);
+        keyFrom = a + 1;
+        cut = b - a - 1;
+        partial.push_back({a, bound(a - 1), bound(a)});
+        partial.push_back({a + 1, bound(b - 1), bound(b)});
+    }
+
+    if (cut > 0)
+    {
+        std::vector<int> dropped(children + childFrom, children + childFrom + cut);
+
+        for (int i = keyFrom + cut; i < numKeys; i++)
+            keys[i - cut] = keys[i];
+        for (int i = childFrom + cut; i <= numKeys; i++)
+        {
+            children[i - cut] = children[i];
+            childCounts[i - cut] = childCounts[i];
+        }
+
+        numKeys -= cut;
+        cache.markDirty(index);
+
+        for (int child : dropped)
+            btree.freeSubtree(child, height - 1);
+    }
+
+    for (const Boundary &child : partial)
+    {
+        cache.get(children[child.slot])->removeRange(lo, hi, child.lower, child.upper, height - 1, leftover);
+        refreshCount(child.slot);
+    }
+
+    repairChildren();
+}
+
+/* merges or refills child idx until it has t-1 keys again, returns where it ended up */
+int BTreeNode::repairChild(int idx)
+{
+    NodeCache &cache = btree.nodeCache();
+
+    while (numKeys > 0)
+    {
+        BTreeNode *child = cache.get(children[idx]);
+        if (child->numKeys - child->numDeleted >= t - 1)
+            break;
+        child->purge();
+
+        int sib = idx > 0 ? idx - 1 : idx + 1;
+        BTreeNode *sibling = cache.get(children[sib]);
+        sibling->purge();
+
+        if (child->numKeys + sibling->numKeys + 1 <= 2 * t - 1)
+        {
+            idx = std::min(idx, sib);
+            merge(idx);
+        }
+        else
+        {
+            while (child->numKeys < t - 1)
+            {
+                if (sib < idx)
+                    borrowFromPrev(idx);
+                else
+                    borrowFromNext(idx);
+            }
+        }
+
+        /* what it took from the sibling is whole, but its own children may be short too */
+        cache.get(children[idx])->repairChildren();
+    }
+    return idx;
+}
+
+void BTreeNode::repairChildren()
+{
+    if (isLeaf)
+        return;
+
+    for (int i = 0; i <= numKeys; i++)
+        i = repairChild(i);
+}
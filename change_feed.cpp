@@ -0,0 +1,363 @@
+#include "btree.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static bool writeAll(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buffer, len);
+        if (n <= 0)
+            return false;
+
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buffer, len);
+        if (n <= 0)
+            return false;
+
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* the first sequence number, until anything has been published */
+void ChangeFeed::startAt(uint64_t seq)
+{
+    if (ring.empty() && fd < 0)
+        nextSeq = seq;
+}
+
+/*
+appends every change from now on to path.<first sequence number> segments. a
+new log numbers from 1, otherwise numbering carries on from the newest segment
+and a record torn by a crash is cut off. it has to be opened before the first
+change is published.
+*/
+bool ChangeFeed::openLog(const char *logPath, int64_t bytes, int keep)
+{
+    if (!ring.empty())
+    {
+        std::cerr << "Open the change log before the first change" << std::endl;
+        return false;
+    }
+
+    closeLog();
+    path = logPath;
+    segmentBytes = bytes;
+    keepSegments = keep;
+
+    std::vector<uint64_t> firsts = segments();
+    if (firsts.empty())
+        nextSeq = 1;
+
+    if (firsts.empty() ? !openSegment(nextSeq) : !recoverSegment(firsts.back()))
+    {
+        closeLog();
+        return false;
+    }
+
+    active = true;
+    return true;
+}
+
+void ChangeFeed::closeLog()
+{
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        close(fd);
+        fd = -1;
+    }
+}
+
+void ChangeFeed::stage(const ChangeEvent &change)
+{
+    staged.push_back(change);
+}
+
+/*
+numbers the staged changes, writes them to the log and then hands them to the
+subscribers, so a sequence number a subscriber has seen can always be resumed
+after. durable syncs the log as well, for copy-on-write commits.
+*/
+void ChangeFeed::publish(bool durable)
+{
+    if (staged.empty())
+        return;
+
+    std::vector<ChangeEvent> batch;
+    batch.swap(staged);
+
+    for (ChangeEvent &change : batch)
+    {
+        change.seq = nextSeq++;
+        ring.push_back(change);
+        if (ring.size() > CHANGE_RING_SIZE)
+            ring.pop_front();
+    }
+
+    if (fd >= 0)
+    {
+        size_t bytes = sizeof(ChangeEvent) * batch.size();
+        written += bytes;
+        if (!writeAll(fd, (const char *)batch.data(), bytes) || (durable && fdatasync(fd) != 0))
+        {
+            std::cerr << "Failed to write the change log " << path << ": " << strerror(errno) << std::endl;
+            closeLog();
+        }
+        else if (written >= segmentBytes)
+        {
+            rotate();
+        }
+    }
+
+    /* a subscriber may unsubscribe itself or others from its callback */
+    std::vector<int> ids;
+    for (auto &entry : subscribers)
+        ids.push_back(entry.first);
+
+    for (const ChangeEvent &change : batch)
+    {
+        for (int id : ids)
+        {
+            auto it = subscribers.find(id);
+            if (it != subscribers.end())
+                it->second(change);
+        }
+    }
+}
+
+/*
+calls fn for every change after sequence number after, first those already
+published and then each new one as it is committed. returns an id for
+unsubscribe, or -1 if changes after after are no longer kept.
+*/
+int ChangeFeed::subscribe(uint64_t after, const ChangeFn &fn)
+{
+    active = true;
+
+    std::vector<uint64_t> firsts = fd >= 0 ? segments() : std::vector<uint64_t>();
+    uint64_t oldest = !firsts.empty() ? firsts.front() : !ring.empty() ? ring.front().seq : nextSeq;
+
+    if (after > last() || after + 1 < oldest)
+    {
+        std::cerr << "Changes after " << after << " are no longer kept, read the whole tree again" << std::endl;
+        return -1;
+    }
+
+    if (fd >= 0)
+    {
+        if (!replayLog(after, fn))
+            return -1;
+    }
+    else
+    {
+        for (const ChangeEvent &change : ring)
+        {
+            if (change.seq > after)
+                fn(change);
+        }
+    }
+
+    subscribers[nextId] = fn;
+    return nextId++;
+}
+
+void ChangeFeed::unsubscribe(int id)
+{
+    subscribers.erase(id);
+}
+
+/* the first sequence number of every segment of the log, oldest first */
+std::vector<uint64_t> ChangeFeed::segments() const
+{
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    std::string prefix = (slash == std::string::npos ? path : path.substr(slash + 1)) + ".";
+
+    std::vector<uint64_t> firsts;
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr)
+        return firsts;
+
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != nullptr)
+    {
+        std::string name = entry->d_name;
+        if (name.size() != prefix.size() + 20 || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.find_first_not_of("0123456789", prefix.size()) != std::string::npos)
+            continue;
+
+        firsts.push_back(strtoull(name.c_str() + prefix.size(), nullptr, 10));
+    }
+    closedir(listing);
+
+    std::sort(firsts.begin(), firsts.end());
+    return firsts;
+}
+
+/* zero padded, so the segments list in order */
+std::string ChangeFeed::segmentName(uint64_t first) const
+{
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".%020llu", (unsigned long long)first);
+    return path + suffix;
+}
+
+bool ChangeFeed::openSegment(uint64_t first)
+{
+    std::string name = segmentName(first);
+    fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    int head[2] = {CHANGE_LOG_MAGIC, (int)DATA_SIZE};
+    if (!writeAll(fd, (const char *)head, sizeof(head)))
+    {
+        std::cerr << "Failed to write " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    written = CHANGE_LOG_HEADER_SIZE;
+    return true;
+}
+
+/* reopens the newest segment to append to, numbering carries on after its last record */
+bool ChangeFeed::recoverSegment(uint64_t first)
+{
+    std::string name = segmentName(first);
+    fd = open(name.c_str(), O_RDWR | O_APPEND);
+
+    int head[2] = {0, 0};
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || pread(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+        head[0] != CHANGE_LOG_MAGIC || head[1] != (int)DATA_SIZE)
+    {
+        std::cerr << name << " isn't a change log of this build" << std::endl;
+        return false;
+    }
+
+    int64_t records = (st.st_size - (int64_t)CHANGE_LOG_HEADER_SIZE) / (int64_t)sizeof(ChangeEvent);
+    written = CHANGE_LOG_HEADER_SIZE + records * sizeof(ChangeEvent);
+    if (written < st.st_size && ftruncate(fd, written) != 0)
+    {
+        std::cerr << "Failed to cut the torn record off " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    nextSeq = first;
+    if (records > 0)
+    {
+        ChangeEvent change;
+        if (pread(fd, &change, sizeof(change), written - sizeof(change)) != (ssize_t)sizeof(change))
+            return false;
+        nextSeq = change.seq + 1;
+    }
+    return true;
+}
+
+/* starts a segment at the next sequence number and drops the oldest past keepSegments */
+void ChangeFeed::rotate()
+{
+    closeLog();
+    if (!openSegment(nextSeq))
+    {
+        closeLog();
+        return;
+    }
+
+    std::vector<uint64_t> firsts = segments();
+    for (int i = 0; keepSegments > 0 && i + keepSegments < (int)firsts.size(); i++)
+        unlink(segmentName(firsts[i]).c_str());
+}
+
+bool ChangeFeed::replayLog(uint64_t after, const ChangeFn &fn)
+{
+    std::vector<uint64_t> firsts = segments();
+    std::vector<ChangeEvent> chunk(256);
+
+    for (size_t i = 0; i < firsts.size(); i++)
+    {
+        /* every change in this segment is at or before after */
+        if (i + 1 < firsts.size() && firsts[i + 1] <= after + 1)
+            continue;
+
+        std::string name = segmentName(firsts[i]);
+        int in = open(name.c_str(), O_RDONLY);
+        int head[2] = {0, 0};
+        if (in < 0 || !readAll(in, (char *)head, sizeof(head)) || head[0] != CHANGE_LOG_MAGIC)
+        {
+            std::cerr << "Failed to read " << name << std::endl;
+            if (in >= 0)
+                close(in);
+            return false;
+        }
+
+        ssize_t n;
+        while ((n = read(in, chunk.data(), sizeof(ChangeEvent) * chunk.size())) > 0)
+        {
+            /* the newest segment only holds whole records, it is written between operations */
+            for (size_t j = 0; j < (size_t)n / sizeof(ChangeEvent); j++)
+            {
+                if (chunk[j].seq > after)
+                    fn(chunk[j]);
+            }
+        }
+        close(in);
+    }
+    return true;
+}
+
+/* stages a change to tree, an index into the catalog or -1 for the default tree */
+void BTree::noteChange(int tree, ChangeType type, int key, int last, const char *data)
+{
+    ChangeEvent change;
+    memset(&change, 0, sizeof(change));
+    change.type = type;
+    change.key = key;
+    change.last = last;
+    if (tree >= 0)
+        memcpy(change.tree, headerObj.catalog[tree].name, CATALOG_NAME_SIZE);
+    if (data != nullptr)
+        memcpy(change.data, data, DATA_SIZE);
+
+    changeFeed.stage(change);
+}
+
+/*
+appends every committed change to a log of segments named path.<first sequence
+number>, each rotated once it passes segmentBytes, keeping the newest
+keepSegments (0 keeps them all). sequence numbers carry on from a log already
+there. open it before the first change.
+*/
+bool BTree::openChangeLog(const char *path, int64_t segmentBytes, int keepSegments)
+{
+    return changeFeed.openLog(path, segmentBytes, keepSegments);
+}
+
+/*
+calls fn for every committed change after sequence number after, on the
+writer's thread once the change's operation is done. pass lastChange() after
+reading the tree to follow it from there, or the last sequence number a
+consumer saw to resume. returns -1 if those changes are no longer kept, in the
+log or in memory, and the consumer has to read the whole tree again.
+*/
+int BTree::subscribe(uint64_t after, const ChangeFn &fn)
+{
+    return changeFeed.subscribe(after, fn);
+}
@@ -0,0 +1,84 @@
+#include "btree.h"
+
+/* rough bookkeeping cost of an entry on top of its payload */
+#define COMPRESSED_ENTRY_OVERHEAD 64
+
+void CompressedCache::setCapacity(size_t bytes)
+{
+    capacity = bytes;
+    while (used > capacity && !lru.empty())
+        evictOldest();
+}
+
+bool CompressedCache::get(int index, char raw[PAGE_SIZE])
+{
+    auto it = entries.find(index);
+    if (it == entries.end())
+        return false;
+
+    const std::vector<char> &image = it->second->image;
+    char page[PAGE_SIZE];
+    std::memcpy(page, image.data(), image.size());
+    std::memset(page + image.size(), 0, PAGE_SIZE - image.size());
+
+    const char *decoded = PageCodec::decodePage(page, raw);
+    if (decoded == nullptr)
+    {
+        erase(index);
+        return false;
+    }
+
+    if (decoded != raw)
+        std::memcpy(raw, decoded, PAGE_SIZE);
+
+    /* the page is moving back up into a NodeCache frame, one copy is enough */
+    erase(index);
+    return true;
+}
+
+void CompressedCache::put(int index, const char *raw)
+{
+    if (capacity == 0)
+        return;
+
+    erase(index);
+
+    char page[PAGE_SIZE];
+    int len = PageCodec::encodePage(COMPRESSION_LZ, raw, page);
+    size_t cost = len + COMPRESSED_ENTRY_OVERHEAD;
+    if (cost > capacity)
+        return;
+
+    while (used + cost > capacity && !lru.empty())
+        evictOldest();
+
+    lru.push_front(Entry());
+    lru.front().index = index;
+    lru.front().image.assign(page, page + len);
+    entries[index] = lru.begin();
+    used += cost;
+}
+
+void CompressedCache::erase(int index)
+{
+    auto it = entries.find(index);
+    if (it == entries.end())
+        return;
+
+    used -= it->second->image.size() + COMPRESSED_ENTRY_OVERHEAD;
+    lru.erase(it->second);
+    entries.erase(it);
+}
+
+void CompressedCache::clear()
+{
+    lru.clear();
+    entries.clear();
+    used = 0;
+}
+
+void CompressedCache::evictOldest()
+{
+    /* entries are clean copies of what is on disk, dropping them is free */
+    erase(lru.back().index);
+}
@@ -21,6 +21,8 @@ void Header::setBit(int index, bool value)
         bitmap[byteIndex] |= (1 << bitIndex);
     else
         bitmap[byteIndex] &= ~(1 << bitIndex);
+
+    isDirty = true;
 }
 
 void Header::deserializeHeader()
@@ -30,13 +32,25 @@ void Header::deserializeHeader()
 
     memcpy(&rootIndex, buffer, ROOT_INDEX_SIZE);
     memcpy(bitmap, buffer + ROOT_INDEX_SIZE, BITMAP_SIZE);
+
+    /* files from before the extension have bitmap bits there, the magic tells them apart */
+    int ext[HEADER_EXT_SIZE / sizeof(int)];
+    memcpy(ext, buffer + ROOT_INDEX_SIZE + BITMAP_SIZE, HEADER_EXT_SIZE);
+    filterPage = ext[0] == HEADER_EXT_MAGIC ? ext[1] : 0;
+    warmupPage = ext[0] == HEADER_EXT_MAGIC ? ext[2] : 0;
+    catalogPage = ext[0] == HEADER_EXT_MAGIC ? ext[3] : 0;
+    readCatalog();
 }
 
 void Header::writeHeader()
 {
+    if (catalogDirty)
+        writeCatalog();
+
     char buffer[PAGE_SIZE];
     serializeHeader(buffer);
     pager.writePage(0, buffer);
+    isDirty = false;
 }
 
 void Header::serializeHeader(char buffer[PAGE_SIZE])
@@ -44,6 +58,9 @@ void Header::serializeHeader(char buffer[PAGE_SIZE])
     memset(buffer, 0, PAGE_SIZE);
     memcpy(buffer, &rootIndex, ROOT_INDEX_SIZE);
     memcpy(buffer + ROOT_INDEX_SIZE, bitmap, BITMAP_SIZE);
+
+    int ext[HEADER_EXT_SIZE / sizeof(int)] = {HEADER_EXT_MAGIC, filterPage, warmupPage, catalogPage};
+    memcpy(buffer + ROOT_INDEX_SIZE + BITMAP_SIZE, ext, HEADER_EXT_SIZE);
 }
 
 void Header::freeIndex(int index)
@@ -54,6 +71,13 @@ void Header::freeIndex(int index)
     setBit(index, false);
 }
 
+/* frees every page at once */
+void Header::clear()
+{
+    memset(bitmap, 0, BITMAP_SIZE);
+    isDirty = true;
+}
+
 void Header::setIndex(int index)
 {
     if (index < 0)
@@ -66,6 +90,13 @@ int Header::nextFree()
 {
     for (int i = 1; i < MAX_PAGES; i++)
     {
+        /* whole bytes of allocated pages are skipped, so large trees don't pay a bit test per page */
+        if (i % BITS_PER_BYTE == 0 && bitmap[i / BITS_PER_BYTE] == 0xFF)
+        {
+            i += BITS_PER_BYTE - 1;
+            continue;
+        }
+
         if (!getBit(i))
         {
             setIndex(i);
@@ -83,4 +114,78 @@ bool Header::isAllocated(int index)
 void Header::setRootIndex(int index)
 {
     rootIndex = index;
-}
\ No newline at end of file
+    isDirty = true;
+}
+void Header::readCatalog()
+{
+    catalog.clear();
+    catalogDirty = false;
+    if (catalogPage <= 0)
+        return;
+
+    char buffer[PAGE_SIZE];
+    pager.getPage(buffer, catalogPage);
+
+    int head[2];
+    memcpy(head, buffer, CATALOG_HEADER_SIZE);
+    if (head[0] != CATALOG_MAGIC || head[1] < 0 || head[1] > MAX_TREES)
+    {
+        std::cerr << "Corrupt tree catalog on page " << catalogPage << std::endl;
+        return;
+    }
+
+    catalog.resize(head[1]);
+    memcpy(catalog.data(), buffer + CATALOG_HEADER_SIZE, sizeof(CatalogEntry) * head[1]);
+}
+
+/*
+the catalog goes to a fresh page on every change and is synced before the
+header that points at it, so a crash leaves either the old catalog or the new.
+*/
+void Header::writeCatalog()
+{
+    int old = catalogPage;
+    catalogPage = 0;
+
+    if (!catalog.empty())
+    {
+        int index = nextFree();
+        if (index < 0)
+        {
+            std::cerr << "No free page for the tree catalog" << std::endl;
+            catalogPage = old;
+            return;
+        }
+
+        char buffer[PAGE_SIZE];
+        memset(buffer, 0, PAGE_SIZE);
+        int head[2] = {CATALOG_MAGIC, (int)catalog.size()};
+        memcpy(buffer, head, CATALOG_HEADER_SIZE);
+        memcpy(buffer + CATALOG_HEADER_SIZE, catalog.data(), sizeof(CatalogEntry) * catalog.size());
+
+        pager.writePage(index, buffer);
+        pager.sync();
+        catalogPage = index;
+    }
+
+    freeIndex(old);
+    catalogDirty = false;
+}
+
+/* index into catalog, or -1 */
+int Header::findTree(const char *name)
+{
+    for (size_t i = 0; i < catalog.size(); i++)
+    {
+        if (strncmp(catalog[i].name, name, CATALOG_NAME_SIZE) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+void Header::setTreeRoot(int tree, int index)
+{
+    catalog[tree].root = index;
+    catalogDirty = true;
+    isDirty = true;
+}
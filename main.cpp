@@ -16,6 +16,11 @@ void displayMenu()
     std::cout << "5. Search for 50 keys" << '\n';
     std::cout << "6. Traverse the tree" << '\n';
     std::cout << "7. Exit" << '\n';
+    std::cout << "8. Remove a key range" << '\n';
+    std::cout << "9. Remove all keys" << '\n';
+    std::cout << "10. Check the tree" << '\n';
+    std::cout << "11. Export the tree to CSV" << '\n';
+    std::cout << "12. Show changes" << '\n';
     std::cout << "Enter your choice: ";
 }
 
@@ -45,6 +50,95 @@ void handleInsert(BTree &btree)
     }
 }
 
+void handleRemoveRange(BTree &btree)
+{
+    std::string input;
+    int lo, hi;
+
+    std::cout << "Enter the first and last key to remove: ";
+    std::getline(std::cin, input);
+    std::stringstream ss_range(input);
+
+    if (ss_range >> lo >> hi && lo <= hi)
+    {
+        btree.removeRange(lo, hi);
+        std::cout << "Keys " << lo << " to " << hi << " removed." << '\n';
+    }
+    else
+    {
+        std::cout << "Invalid range. Please enter two numbers, the first no larger than the second." << '\n';
+    }
+}
+
+void handleTruncate(BTree &btree)
+{
+    std::string input;
+
+    std::cout << "Remove every key in the tree? (y/n): ";
+    std::getline(std::cin, input);
+
+    if (input == "y" || input == "Y")
+    {
+        btree.truncate();
+        std::cout << "All keys removed." << '\n';
+    }
+    else
+    {
+        std::cout << "Nothing removed." << '\n';
+    }
+}
+
+void handleExport(BTree &btree)
+{
+    std::string path;
+
+    std::cout << "Enter the file to export to: ";
+    std::getline(std::cin, path);
+
+    if (path.empty())
+    {
+        std::cout << "Invalid file name." << '\n';
+        return;
+    }
+
+    ExportSink sink(path.c_str(), EXPORT_CSV);
+    if (btree.parallelScan(sink))
+        std::cout << sink.count() << " keys exported to " << path << "." << '\n';
+    else
+        std::cout << "Export to " << path << " failed." << '\n';
+}
+
+void handleChanges(BTree &btree)
+{
+    static const char *names[] = {"insert", "update", "remove", "remove range", "truncate", "drop tree"};
+    std::string input;
+    uint64_t after;
+
+    std::cout << "Show changes after sequence number (last is " << btree.lastChange() << "): ";
+    std::getline(std::cin, input);
+    std::stringstream ss_after(input);
+
+    if (!(ss_after >> after))
+    {
+        std::cout << "Invalid sequence number." << '\n';
+        return;
+    }
+
+    int id = btree.subscribe(after, [](const ChangeEvent &change) {
+        std::cout << change.seq << " " << names[change.type];
+        if (change.tree[0] != '\0')
+            std::cout << " tree " << change.tree;
+        if (change.type == CHANGE_REMOVE_RANGE)
+            std::cout << " " << change.key << " to " << change.last;
+        else if (change.type <= CHANGE_REMOVE)
+            std::cout << " " << change.key;
+        if (change.type <= CHANGE_UPDATE)
+            std::cout << " -> \"" << std::string(change.data, strnlen(change.data, DATA_SIZE)) << "\"";
+        std::cout << '\n';
+    });
+    btree.unsubscribe(id);
+}
+
 void handleRemove(BTree &btree)
 {
     std::string input;
@@ -56,8 +150,10 @@ void handleRemove(BTree &btree)
 
     if (ss_remove >> key)
     {
-        btree.remove(key);
-        std::cout << "Key " << key << " removed (if present)." << '\n';
+        if (btree.remove(key))
+            std::cout << "Key " << key << " removed." << '\n';
+        else
+            std::cout << "Key " << key << " not found." << '\n';
     }
     else
     {
@@ -128,7 +224,34 @@ int main(int argc, char **argv)
 {
 
     BTree btree;
-    if (argc > 1 && std::strcmp(argv[1], "memory") == 0)
+    bool inMem = false;
+    const char *tree = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "memory") == 0)
+            inMem = true;
+        else if (std::strcmp(argv[i], "compress") == 0)
+            btree.setCompression(COMPRESSION_LZ);
+        else if (std::strcmp(argv[i], "cow") == 0)
+            btree.setCopyOnWrite(true);
+        else if (std::strcmp(argv[i], "lazy") == 0)
+            btree.setLazyDelete(true);
+        else if (std::strcmp(argv[i], "filter") == 0)
+            btree.setKeyFilter(10);
+        else if (std::strcmp(argv[i], "warmup") == 0)
+            btree.setWarmup(true, 64);
+        else if (std::strcmp(argv[i], "direct") == 0)
+            btree.setDirectIO(true);
+        else if (std::strncmp(argv[i], "buffer=", 7) == 0)
+            btree.setWriteBuffer(atoi(argv[i] + 7));
+        else if (std::strncmp(argv[i], "changes=", 8) == 0)
+            btree.openChangeLog(argv[i] + 8);
+        else if (std::strncmp(argv[i], "tree=", 5) == 0)
+            tree = argv[i] + 5;
+    }
+
+    if (inMem)
     {
         btree.init(true, true);
     }
@@ -138,6 +261,16 @@ int main(int argc, char **argv)
         btree.init(!btree.openFile("test.db"), false);
     }
 
+    /* work on a named tree in the same file, created on first use */
+    if (tree != nullptr)
+    {
+        std::vector<std::string> names = btree.trees();
+        if (std::find(names.begin(), names.end(), tree) == names.end() && !btree.createTree(tree))
+            return 1;
+        if (btree.useTree(tree))
+            std::cout << "Using tree " << tree << '\n';
+    }
+
     std::string input;
     int choice;
 
@@ -186,12 +319,35 @@ int main(int argc, char **argv)
             break;
 
         case 7:
+            /* returning runs the tree's destructor, which applies buffered writes and saves the filter */
             std::cout << "Exiting the program..." << '\n';
-            exit(0);
+            return 0;
+
+        case 8:
+            handleRemoveRange(btree);
+            break;
+
+        case 9:
+            handleTruncate(btree);
+            break;
+
+        case 10:
+            if (btree.verify())
+                std::cout << "The tree is consistent." << '\n';
+            else
+                std::cout << "The tree has problems, see above." << '\n';
+            break;
+
+        case 11:
+            handleExport(btree);
+            break;
+
+        case 12:
+            handleChanges(btree);
             break;
 
         default:
-            std::cout << "Invalid choice. Please select a valid option (1-7)." << '\n';
+            std::cout << "Invalid choice. Please select a valid option (1-12)." << '\n';
             break;
         }
     }
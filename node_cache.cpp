@@ -1,240 +1,489 @@
 #include "btree.h"
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* frames are cache line aligned within a slab, slabs themselves are page aligned */
+#define FRAME_ALIGN 64
+#define FRAME_STRIDE ((sizeof(BTreeNode) + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1))
+#define SLAB_GROW_FRAMES 8
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+NodeCache::~NodeCache()
+{
+    freeSlabs();
+    free(runBuffer);
+}
 
 void NodeCache::init(bool inMem, BTree &b)
 {
     btreePtr = &b;
-    /* in memory for testing btree ops */
+    /* in memory, nodes are only written out when a spill limit is set */
     isInMemMode = inMem;
-    for (int i = 0; i < MAX_CACHE_SIZE; i++)
-    {
-        cache[i].node = nullptr;
-        cache[i].nodeIndex = -1;
-        cache[i].isDirty = false;
-        lruList[i] = -1;
-    }
 
+    freeSlabs();
     nodeIndexToCachePos.clear();
-    lruCount = 0;
+    pageFrames.assign(inMem ? MAX_PAGES : 0, -1);
+    lruHead = -1;
+    lruTail = -1;
+    inOp = false;
+    compressedCache.clear();
+
+    if (inMem && spillLimit > 0 && pager.fd < 0 && pager.openTemporary())
+        capacity = spillLimit;
+
+    addSlab(capacity);
 }
 
-int NodeCache::findInLru(int cachePos)
+/*
+maps bytes, rounded up to whole huge pages. MAP_HUGETLB only works when the
+admin has reserved huge pages, otherwise the slab is aligned to a huge page and
+left to transparent huge pages, which back it as it is touched.
+*/
+static char *mapHuge(size_t &bytes)
 {
-    for (int i = 0; i < lruCount; i++)
+    size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    void *memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED)
     {
-        if (lruList[i] == cachePos)
-        {
-            return i;
-        }
+        bytes = rounded;
+        return (char *)memory;
     }
-    return -1;
+#endif
+
+    /* map a huge page extra so there is an aligned start in it, and give the ends back */
+    char *start = (char *)mmap(nullptr, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == (char *)MAP_FAILED)
+        return nullptr;
+
+    char *aligned = (char *)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > start)
+        munmap(start, aligned - start);
+    munmap(aligned + rounded, start + HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, rounded, MADV_HUGEPAGE);
+#endif
+    bytes = rounded;
+    return aligned;
 }
 
-void NodeCache::updateLru(int cachePos)
+/* asks the kernel to place the slab's pages on numaNode. nothing is placed until a frame is first used */
+void NodeCache::bindSlab(const Slab &slab)
 {
-    int pos = findInLru(cachePos);
+#ifdef SYS_mbind
+    const int bits = sizeof(unsigned long) * BITS_PER_BYTE;
+    std::vector<unsigned long> mask(numaNode / bits + 1, 0);
+    mask[numaNode / bits] = 1UL << (numaNode % bits);
+
+    if (syscall(SYS_mbind, slab.memory, slab.bytes, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0) == 0)
+        return;
+#endif
 
-    if (pos != -1)
+    std::cerr << "Can't place the cache on NUMA node " << numaNode << ", using the default placement" << std::endl;
+    numaNode = -1;
+}
+
+void NodeCache::addSlab(int frames)
+{
+    Slab slab = {nullptr, FRAME_STRIDE * frames, false};
+
+    /* a large cache costs a TLB entry per 2 MiB instead of per 4 KiB */
+    if (hugePages && slab.bytes >= HUGE_PAGE_SIZE)
     {
-        for (int i = pos; i > 0; i--)
-        {
-            lruList[i] = lruList[i - 1];
-        }
+        slab.memory = mapHuge(slab.bytes);
+        slab.huge = slab.memory != nullptr;
     }
-    else
+
+    if (slab.memory == nullptr)
     {
-        if (lruCount < MAX_CACHE_SIZE)
-        {
-            for (int i = lruCount; i > 0; i--)
-            {
-                lruList[i] = lruList[i - 1];
-            }
-            lruCount++;
-        }
-        else
+        void *memory = mmap(nullptr, slab.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
         {
-            std::cerr << "LRU list is full but node not found" << std::endl;
-            return;
+            throw std::bad_alloc();
         }
+        slab.memory = (char *)memory;
     }
 
-    lruList[0] = cachePos;
+    if (numaNode >= 0)
+        bindSlab(slab);
+
+    slabs.push_back(slab);
+    char *memory = slab.memory;
+
+    for (int i = 0; i < frames; i++)
+    {
+        CacheEntry entry;
+        entry.node = nullptr;
+        entry.memory = memory + FRAME_STRIDE * i;
+        entry.nodeIndex = -1;
+        entry.isDirty = false;
+        entry.pins = 0;
+        entry.opEpoch = 0;
+        entry.prev = -1;
+        entry.next = -1;
+
+        freeFrames.push_back((int)cache.size());
+        cache.push_back(entry);
+    }
+}
+
+void NodeCache::freeSlabs()
+{
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+        if (cache[i].node != nullptr)
+            cache[i].node->~BTreeNode();
+    }
+
+    for (size_t i = 0; i < slabs.size(); i++)
+        munmap(slabs[i].memory, slabs[i].bytes);
+
+    slabs.clear();
+    cache.clear();
+    freeFrames.clear();
+}
+
+/* bytes of the frame pool mapped for huge pages */
+size_t NodeCache::hugePageBytes() const
+{
+    size_t bytes = 0;
+    for (const Slab &slab : slabs)
+    {
+        if (slab.huge)
+            bytes += slab.bytes;
+    }
+    return bytes;
+}
+
+void NodeCache::lruUnlink(int cachePos)
+{
+    CacheEntry &entry = cache[cachePos];
+
+    if (entry.prev != -1)
+        cache[entry.prev].next = entry.next;
+    else if (lruHead == cachePos)
+        lruHead = entry.next;
+
+    if (entry.next != -1)
+        cache[entry.next].prev = entry.prev;
+    else if (lruTail == cachePos)
+        lruTail = entry.prev;
+
+    entry.prev = -1;
+    entry.next = -1;
+}
+
+void NodeCache::lruPushFront(int cachePos)
+{
+    cache[cachePos].prev = -1;
+    cache[cachePos].next = lruHead;
+
+    if (lruHead != -1)
+        cache[lruHead].prev = cachePos;
+    lruHead = cachePos;
+
+    if (lruTail == -1)
+        lruTail = cachePos;
+}
+
+void NodeCache::updateLru(int cachePos)
+{
+    if (lruHead == cachePos)
+        return;
+
+    lruUnlink(cachePos);
+    lruPushFront(cachePos);
+}
+
+/* marks a frame as used by the running operation so it can't be evicted under it */
+void NodeCache::touch(int cachePos)
+{
+    if (inOp)
+        cache[cachePos].opEpoch = opEpoch;
+    updateLru(cachePos);
+}
+
+bool NodeCache::isPinned(int cachePos)
+{
+    return cache[cachePos].pins > 0 || (inOp && cache[cachePos].opEpoch == opEpoch);
+}
+
+/*
+insert and remove keep raw node pointers across several cache lookups, so every
+frame they touch stays resident until the operation ends. an operation touches
+a few nodes per level, if that outgrows the slab the cache grows instead of
+evicting a node that is still in use.
+*/
+void NodeCache::beginOp()
+{
+    inOp = true;
+    opEpoch++;
+}
+
+void NodeCache::endOp()
+{
+    inOp = false;
+}
+
+void NodeCache::pin(int nodeIndex)
+{
+    auto it = nodeIndexToCachePos.find(nodeIndex);
+    if (it != nodeIndexToCachePos.end())
+        cache[it->second].pins++;
+}
+
+void NodeCache::unpin(int nodeIndex)
+{
+    auto it = nodeIndexToCachePos.find(nodeIndex);
+    if (it != nodeIndexToCachePos.end() && cache[it->second].pins > 0)
+        cache[it->second].pins--;
 }
 
 int NodeCache::findFreeCacheSlot(void)
 {
-    for (int i = 0; i < MAX_CACHE_SIZE; i++)
+    if (freeFrames.empty())
     {
-        if (cache[i].node == nullptr)
-        {
-            return i;
-        }
+        /* memory mode without a spill file has nowhere to put a node, it grows by half instead */
+        bool canEvict = !isInMemMode || pager.fd >= 0;
+        int evicted = canEvict ? evictLruIfNeeded() : -1;
+        if (evicted >= 0)
+            return evicted;
+
+        addSlab(canEvict ? SLAB_GROW_FRAMES : std::max(SLAB_GROW_FRAMES, (int)cache.size() / 2));
     }
 
-    return evictLruIfNeeded();
+    int cachePos = freeFrames.back();
+    freeFrames.pop_back();
+    return cachePos;
 }
 
+/* returns a frame freed by evicting the least recently used unpinned node, or -1 */
 int NodeCache::evictLruIfNeeded(void)
 {
-    if (lruCount == 0)
+    int lruCachePos = lruTail;
+    while (lruCachePos != -1 && isPinned(lruCachePos))
+        lruCachePos = cache[lruCachePos].prev;
+
+    if (lruCachePos == -1)
     {
-        std::cerr << "Error: Cannot evict from empty cache" << std::endl;
         return -1;
     }
 
-    int lruCachePos = lruList[lruCount - 1];
     int nodeIndex = cache[lruCachePos].nodeIndex;
 
-    if (!isInMemMode && cache[lruCachePos].isDirty && cache[lruCachePos].node != nullptr)
-    {
-        char buffer[PAGE_SIZE];
-        serializeNode(cache[lruCachePos].node, buffer);
-        pager.writePage(nodeIndex, buffer);
-    }
+    TRACE_EVENT(*btreePtr, TRACE_EVICT, nodeIndex, cache[lruCachePos].isDirty);
 
-    if (cache[lruCachePos].node != nullptr)
+    if (cache[lruCachePos].isDirty || compressedCache.enabled())
     {
-        cache[lruCachePos].node = nullptr;
-    }
+        alignas(PAGE_SIZE) char raw[PAGE_SIZE];
+        serializeNode(cache[lruCachePos].node, raw);
 
-    nodeIndexToCachePos.erase(nodeIndex);
+        if (cache[lruCachePos].isDirty)
+            writeSerialized(raw, nodeIndex);
 
-    cache[lruCachePos].nodeIndex = -1;
-    cache[lruCachePos].isDirty = false;
+        /* once written back the page is clean, keep a compressed copy around */
+        compressedCache.put(nodeIndex, raw);
+    }
 
-    lruCount--;
+    release(lruCachePos);
+    freeFrames.pop_back();
+    stats.add(STAT_EVICTIONS);
 
     return lruCachePos;
 }
 
+void NodeCache::install(int cachePos, BTreeNode *node, bool dirty)
+{
+    cache[cachePos].node = node;
+    cache[cachePos].nodeIndex = node->index;
+    cache[cachePos].isDirty = dirty;
+    cache[cachePos].pins = 0;
+
+    nodeIndexToCachePos[node->index] = cachePos;
+    if (isInMemMode)
+        pageFrames[node->index] = cachePos;
+    lruPushFront(cachePos);
+    touch(cachePos);
+}
+
+/* drops the node held by a frame without writing it back and returns the frame to the free list */
+void NodeCache::release(int cachePos)
+{
+    CacheEntry &entry = cache[cachePos];
+
+    nodeIndexToCachePos.erase(entry.nodeIndex);
+    if (isInMemMode)
+        pageFrames[entry.nodeIndex] = -1;
+    lruUnlink(cachePos);
+
+    entry.node->~BTreeNode();
+    entry.node = nullptr;
+    entry.nodeIndex = -1;
+    entry.isDirty = false;
+    entry.pins = 0;
+
+    freeFrames.push_back(cachePos);
+}
+
 BTreeNode *NodeCache::get(int nodeIndex)
 {
-    if (nodeIndex <= 0)
+    if (nodeIndex <= 0 || nodeIndex >= MAX_PAGE_COUNT)
     {
         std::cerr << "Invalid node index: " << nodeIndex << std::endl;
         return nullptr;
     }
 
+    nodeIndex = resolve(nodeIndex);
+
+    /* memory mode finds nodes by page, the lru order only matters once nodes can be spilled */
+    if (isInMemMode && pageFrames[nodeIndex] >= 0)
+    {
+        int cachePos = pageFrames[nodeIndex];
+        if (pager.fd >= 0)
+            touch(cachePos);
+        stats.add(STAT_CACHE_HITS);
+        return cache[cachePos].node;
+    }
+
     auto it = nodeIndexToCachePos.find(nodeIndex);
     if (it != nodeIndexToCachePos.end())
     {
         int cachePos = it->second;
-        updateLru(cachePos);
+        touch(cachePos);
+        stats.add(STAT_CACHE_HITS);
         return cache[cachePos].node;
     }
 
-    if (isInMemMode)
+    stats.add(STAT_CACHE_MISSES);
+
+    /* nothing was ever spilled, the page never held a node */
+    if (isInMemMode && pager.fd < 0)
     {
-        throw std::runtime_error("Too many nodes requested");
+        std::cerr << "No node at index: " << nodeIndex << std::endl;
         return nullptr;
     }
 
-    char pageBuffer[PAGE_SIZE];
-    pager.getPage(pageBuffer, nodeIndex);
+    alignas(PAGE_SIZE) char page[PAGE_SIZE];
+    char scratch[PAGE_SIZE];
+    const char *raw;
 
-    BTreeNode *node = deserializeNode(pageBuffer);
-    if (node == nullptr)
+    if (compressedCache.get(nodeIndex, scratch))
+    {
+        raw = scratch;
+        stats.add(STAT_TIER_HITS);
+    }
+    else
+        raw = readPage(nodeIndex, page, scratch);
+
+    if (raw == nullptr)
     {
         return nullptr;
     }
 
     int cachePos = findFreeCacheSlot();
-    if (cachePos < 0)
+
+    BTreeNode *node = deserializeNode(raw, cache[cachePos].memory);
+    if (node == nullptr)
     {
-        std::cerr << "Failed to find cache slot" << std::endl;
+        freeFrames.push_back(cachePos);
         return nullptr;
     }
 
-    cache[cachePos].node = node;
-    cache[cachePos].nodeIndex = nodeIndex;
-    cache[cachePos].isDirty = false;
-
-    nodeIndexToCachePos[nodeIndex] = cachePos;
-    updateLru(cachePos);
+    install(cachePos, node, false);
 
     return node;
 }
 
-void NodeCache::add(int nodeIndex, BTreeNode *node)
+/* constructs a new node in a cache frame, it starts out dirty */
+BTreeNode *NodeCache::create(bool leaf, int nodeIndex)
 {
-    if (nodeIndex <= 0 || node == nullptr)
+    if (nodeIndex <= 0 || nodeIndex >= MAX_PAGE_COUNT || btreePtr == nullptr)
     {
-        std::cerr << "Invalid node index or nullptr node" << std::endl;
-        return;
+        std::cerr << "Invalid node index: " << nodeIndex << std::endl;
+        return nullptr;
     }
 
-    auto it = nodeIndexToCachePos.find(nodeIndex);
-    if (it != nodeIndexToCachePos.end())
-    {
-        int cachePos = it->second;
-        cache[cachePos].node = node;
-        cache[cachePos].isDirty = true;
-        updateLru(cachePos);
-        return;
-    }
+    /* the page may have belonged to a freed node, any older copy is stale */
+    compressedCache.erase(nodeIndex);
 
-    int cachePos = findFreeCacheSlot();
-    if (cachePos < 0)
-    {
-        std::cerr << "Failed to find cache slot" << std::endl;
-        return;
-    }
+    /* a warm-up manifest from before a crash can bring back a page that was freed since */
+    auto stale = nodeIndexToCachePos.find(nodeIndex);
+    if (stale != nodeIndexToCachePos.end())
+        release(stale->second);
 
-    cache[cachePos].node = node;
-    cache[cachePos].nodeIndex = nodeIndex;
-    cache[cachePos].isDirty = true;
+    if (cowMode)
+        freshPages.insert(nodeIndex);
 
-    nodeIndexToCachePos[nodeIndex] = cachePos;
-    updateLru(cachePos);
+    int cachePos = findFreeCacheSlot();
+    BTreeNode *node = new (cache[cachePos].memory) BTreeNode(leaf, nodeIndex, *btreePtr);
+    install(cachePos, node, true);
+
+    return node;
 }
 
-void NodeCache::remove(int nodeIndex)
+/* drops a node that is no longer part of the tree and frees its page */
+void NodeCache::destroy(BTreeNode *node)
 {
-    auto it = nodeIndexToCachePos.find(nodeIndex);
-    if (it == nodeIndexToCachePos.end())
-    {
-        return;
-    }
+    destroyPage(node->index);
+}
+/* frees a node's page whether or not it is cached, so freed subtrees need not be read */
+void NodeCache::destroyPage(int nodeIndex)
+{
+    nodeIndex = resolve(nodeIndex);
 
-    int cachePos = it->second;
+    compressedCache.erase(nodeIndex);
 
-    if (!isInMemMode && cache[cachePos].isDirty && cache[cachePos].node != nullptr)
+    if (cowMode && freshPages.count(nodeIndex) == 0)
     {
-        char buffer[PAGE_SIZE];
-        serializeNode(cache[cachePos].node, buffer);
-        pager.writePage(nodeIndex, buffer);
+        /* still part of the committed tree */
+        retire(nodeIndex);
     }
-
-    if (cache[cachePos].node != nullptr)
+    else
     {
-        cache[cachePos].node = nullptr;
+        header.freeIndex(nodeIndex);
     }
 
-    cache[cachePos].nodeIndex = -1;
-    cache[cachePos].isDirty = false;
-
-    nodeIndexToCachePos.erase(nodeIndex);
-
-    int lruPos = findInLru(cachePos);
-    if (lruPos != -1)
+    if (cowMode)
     {
-        for (int i = lruPos; i < lruCount - 1; i++)
+        freshPages.erase(nodeIndex);
+
+        /* a copy made earlier in this transaction no longer needs linking in */
+        auto copy = relocatedFrom.find(nodeIndex);
+        if (copy != relocatedFrom.end())
         {
-            lruList[i] = lruList[i + 1];
+            remap.erase(copy->second);
+            relocatedFrom.erase(copy);
         }
-        lruCount--;
+    }
+
+    auto it = nodeIndexToCachePos.find(nodeIndex);
+    if (it != nodeIndexToCachePos.end())
+    {
+        release(it->second);
     }
 }
 
 void NodeCache::markDirty(int nodeIndex)
 {
-    if (isInMemMode)
+    if (isInMemMode && pager.fd < 0)
     {
         return;
     }
+    nodeIndex = resolve(nodeIndex);
+
     auto it = nodeIndexToCachePos.find(nodeIndex);
     if (it != nodeIndexToCachePos.end())
     {
         int cachePos = it->second;
+
+        if (cowMode && freshPages.count(nodeIndex) == 0)
+            relocate(cachePos);
+
         cache[cachePos].isDirty = true;
     }
 }
@@ -246,41 +495,67 @@ void NodeCache::sync()
         return;
     }
 
-    for (int i = 0; i < MAX_CACHE_SIZE; i++)
+    if (warmupInterval > 0 && ++syncsSinceWarmup >= warmupInterval)
+    {
+        syncsSinceWarmup = 0;
+        saveWarmup();
+    }
+
+    if (cowMode)
+    {
+        commit();
+        return;
+    }
+
+    for (size_t i = 0; i < cache.size(); i++)
     {
         if (cache[i].isDirty && cache[i].node != nullptr)
         {
-            char buffer[PAGE_SIZE];
-            serializeNode(cache[i].node, buffer);
-            pager.writePage(cache[i].nodeIndex, buffer);
+            writeNode(cache[i].node, cache[i].nodeIndex);
             cache[i].isDirty = false;
         }
     }
 
+    /* splits and merges allocate and free pages without touching the root */
+    if (header.isDirty)
+        header.writeHeader();
+
     pager.flush();
+
+    if (btreePtr != nullptr)
+        btreePtr->recordChanges(writtenPages);
+    writtenPages.clear();
 }
 
 void NodeCache::serializeNode(BTreeNode *node, char *buffer)
 {
     std::memset(buffer, 0, PAGE_SIZE);
 
-    int numChildren = node->isLeaf ? 0 : node->numKeys + 1;
+    int numChildren = node->isLeaf ? (node->numDeleted > 0 ? LEAF_TOMBSTONES : 0) : node->numKeys + 1;
 
     std::memcpy(buffer, &(node->index), sizeof(int));
     std::memcpy(buffer + sizeof(int), &(node->numKeys), sizeof(int));
     std::memcpy(buffer + 2 * sizeof(int), &numChildren, sizeof(int));
 
+    /* slots past numKeys hold leftovers, the page keeps them zeroed */
     char *kvStart = buffer + NODE_HEADER_SIZE;
-    std::memcpy(kvStart, node->keys, sizeof(KeyValue) * MAX_KEYS);
+    std::memcpy(kvStart, node->keys, sizeof(KeyValue) * node->numKeys);
 
     if (!node->isLeaf)
     {
         char *childStart = kvStart + (sizeof(KeyValue) * MAX_KEYS);
         std::memcpy(childStart, node->children, sizeof(int) * (MAX_KEYS + 1));
+#ifdef BTREE_COUNTS
+        std::memcpy(childStart + CHILD_PTR_SPACE, node->childCounts, CHILD_COUNT_SPACE);
+#endif
+    }
+    else if (node->numDeleted > 0)
+    {
+        std::memcpy(kvStart + (sizeof(KeyValue) * MAX_KEYS), node->tombstones, TOMBSTONE_BYTES);
     }
 }
 
-BTreeNode *NodeCache::deserializeNode(char *buffer)
+bool NodeCache::decodeNode(const char *buffer, BTreeNode *node)
 {
     int index, numKeys, numChildren;
 
@@ -288,26 +563,498 @@ BTreeNode *NodeCache::deserializeNode(char *buffer)
     std::memcpy(&numKeys, buffer + sizeof(int), sizeof(int));
     std::memcpy(&numChildren, buffer + 2 * sizeof(int), sizeof(int));
 
-    if (!btreePtr)
+    if (numKeys < 0 || numKeys > MAX_KEYS)
     {
-        std::cerr << "Error: NodeCache has no associated BTree" << std::endl;
-        return nullptr;
+        std::cerr << "Corrupt node page: " << index << std::endl;
+        return false;
     }
 
-    BTreeNode *node = new BTreeNode((numChildren == 0), index, *btreePtr);
-
     node->index = index;
     node->numKeys = numKeys;
+    node->isLeaf = (numChildren == 0 || numChildren == LEAF_TOMBSTONES);
+    node->numDeleted = 0;
+    std::memset(node->tombstones, 0, TOMBSTONE_BYTES);
 
-    char *kvStart = buffer + NODE_HEADER_SIZE;
+    const char *kvStart = buffer + NODE_HEADER_SIZE;
 
-    std::memcpy(node->keys, kvStart, sizeof(KeyValue) * MAX_KEYS);
+    std::memcpy(node->keys, kvStart, sizeof(KeyValue) * numKeys);
 
     if (!node->isLeaf)
     {
-        char *childStart = kvStart + (sizeof(KeyValue) * MAX_KEYS);
+        const char *childStart = kvStart + (sizeof(KeyValue) * MAX_KEYS);
         std::memcpy(node->children, childStart, sizeof(int) * (MAX_KEYS + 1));
+#ifdef BTREE_COUNTS
+        std::memcpy(node->childCounts, childStart + CHILD_PTR_SPACE, CHILD_COUNT_SPACE);
+#endif
+    }
+    else if (numChildren == LEAF_TOMBSTONES)
+    {
+        std::memcpy(node->tombstones, kvStart + (sizeof(KeyValue) * MAX_KEYS), TOMBSTONE_BYTES);
+        for (int i = 0; i < numKeys; i++)
+            node->numDeleted += node->isDeleted(i);
+    }
+
+    return true;
+}
+
+BTreeNode *NodeCache::deserializeNode(const char *buffer, char *memory)
+{
+    if (!btreePtr)
+    {
+        std::cerr << "Error: NodeCache has no associated BTree" << std::endl;
+        return nullptr;
+    }
+
+    BTreeNode *node = new (memory) BTreeNode(true, 0, *btreePtr);
+
+    if (!decodeNode(buffer, node))
+    {
+        node->~BTreeNode();
+        return nullptr;
     }
 
     return node;
-}
\ No newline at end of file
+}
+
+void NodeCache::writeNode(BTreeNode *node, int nodeIndex)
+{
+    alignas(PAGE_SIZE) char raw[PAGE_SIZE];
+    serializeNode(node, raw);
+    writeSerialized(raw, nodeIndex);
+}
+
+void NodeCache::writeSerialized(const char *raw, int nodeIndex)
+{
+    alignas(PAGE_SIZE) char buffer[PAGE_SIZE];
+
+    /* spilled pages aren't part of any backup */
+    if (!isInMemMode)
+        writtenPages.push_back(nodeIndex);
+    stats.add(STAT_WRITEBACKS);
+
+    if (codec == COMPRESSION_NONE)
+    {
+        pager.writePage(nodeIndex, const_cast<char *>(raw));
+        return;
+    }
+
+    int used = PageCodec::encodePage(codec, raw, buffer);
+    pager.writePage(nodeIndex, buffer);
+
+    if (used < PAGE_SIZE)
+        pager.punchHole(nodeIndex, used);
+}
+
+const char *NodeCache::readPage(int nodeIndex, char *page, char *scratch)
+{
+    pager.getPage(page, nodeIndex);
+
+    /* the page header records how the page was written, so files may mix codecs */
+    return PageCodec::decodePage(page, scratch);
+}
+
+/* copy-on-write: maps a committed page to the copy made of it in this transaction */
+int NodeCache::resolve(int nodeIndex)
+{
+    if (!cowMode || remap.empty())
+        return nodeIndex;
+
+    auto it = remap.find(nodeIndex);
+    return it == remap.end() ? nodeIndex : it->second;
+}
+
+void NodeCache::relocate(int cachePos)
+{
+    BTreeNode *node = cache[cachePos].node;
+    int oldIndex = node->index;
+    int newIndex = header.nextFree();
+
+    if (newIndex < 0)
+    {
+        throw std::runtime_error("No free pages left for copy-on-write");
+    }
+
+    compressedCache.erase(newIndex);
+
+    nodeIndexToCachePos.erase(oldIndex);
+    nodeIndexToCachePos[newIndex] = cachePos;
+    cache[cachePos].nodeIndex = newIndex;
+    node->index = newIndex;
+
+    remap[oldIndex] = newIndex;
+    relocatedFrom[newIndex] = oldIndex;
+    freshPages.insert(newIndex);
+    retire(oldIndex);
+}
+
+/*
+drops every frame and frees every page without writing anything back, for
+BTree::truncate right after a sync. in copy-on-write mode the pages are retired
+instead, so open snapshots keep reading them.
+*/
+void NodeCache::discardAll()
+{
+    std::vector<int> cached;
+    for (auto &entry : nodeIndexToCachePos)
+        cached.push_back(entry.second);
+
+    for (int cachePos : cached)
+        release(cachePos);
+
+    compressedCache.clear();
+    releaseManifest();
+
+    if (!cowMode)
+    {
+        header.clear();
+        return;
+    }
+
+    std::unordered_set<int> pending;
+    for (auto &page : retired)
+        pending.insert(page.second);
+
+    for (int i = 1; i < MAX_PAGE_COUNT; i++)
+    {
+        if (header.getBit(i) && pending.count(i) == 0)
+            retire(i);
+    }
+}
+/* a page leaving the tree in the transaction that will commit as commitVersion + 1 */
+void NodeCache::retire(int nodeIndex)
+{
+    retired.push_back(std::make_pair(commitVersion + 1, nodeIndex));
+}
+
+/* pages retired by version v are still reachable from snapshots older than v */
+void NodeCache::reclaim(uint64_t oldestSnapshot)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++)
+    {
+        if (retired[i].first <= oldestSnapshot)
+            header.freeIndex(retired[i].second);
+        else
+            retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+}
+
+/*
+points parents at the copies made in this transaction. a parent that was still
+committed gets copied in turn, so this repeats until the copies reach the root.
+every parent was touched on the way down and is still pinned in the cache.
+*/
+void NodeCache::fixupRelocations()
+{
+    std::unordered_set<int> linked;
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            BTreeNode *node = cache[i].node;
+            if (node == nullptr || node->isLeaf)
+                continue;
+
+            for (int c = 0; c <= node->numKeys; c++)
+            {
+                /* parents built in this transaction may already point at the copy */
+                auto copy = relocatedFrom.find(node->children[c]);
+                if (copy != relocatedFrom.end())
+                    linked.insert(copy->second);
+
+                auto it = remap.find(node->children[c]);
+                if (it == remap.end() || linked.count(it->first))
+                    continue;
+
+                linked.insert(it->first);
+                node->children[c] = it->second;
+                markDirty(node->index);
+                changed = true;
+            }
+        }
+    }
+
+    int rootIndex = btreePtr->rootIndex();
+    auto root = remap.find(rootIndex);
+    if (root != remap.end())
+    {
+        linked.insert(root->first);
+        btreePtr->setRoot(root->second);
+    }
+    else if (relocatedFrom.count(rootIndex))
+    {
+        linked.insert(relocatedFrom[rootIndex]);
+    }
+
+    for (auto it = remap.begin(); it != remap.end(); ++it)
+    {
+        if (linked.count(it->first) == 0)
+            std::cerr << "Copy-on-write: no parent found for page " << it->first << std::endl;
+    }
+}
+
+/*
+writes the copies made in this transaction to their fresh pages, then swaps the
+root in the header. the old pages are untouched until then, so a crash before
+the header write leaves the previous commit intact.
+*/
+void NodeCache::commit()
+{
+    fixupRelocations();
+
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+        if (cache[i].isDirty && cache[i].node != nullptr)
+        {
+            writeNode(cache[i].node, cache[i].nodeIndex);
+            cache[i].isDirty = false;
+        }
+    }
+    pager.sync();
+
+    commitVersion++;
+    remap.clear();
+    relocatedFrom.clear();
+    freshPages.clear();
+
+    /* publish first, so no snapshot can still pick up the previous root after its pages are reclaimed */
+    if (btreePtr != nullptr)
+    {
+        btreePtr->publish(btreePtr->rootIndex(), commitVersion, writtenPages);
+        reclaim(btreePtr->oldestSnapshot());
+    }
+    writtenPages.clear();
+
+    if (header.isDirty)
+    {
+        header.writeHeader();
+        pager.sync();
+    }
+}
+
+/*
+lists the resident pages in the manifest, most recently used first, so the
+next open can read them back. the manifest reuses the pages of the last save,
+and it is only a hint so it isn't synced on its own.
+*/
+void NodeCache::saveWarmup()
+{
+    if (isInMemMode || pager.fd < 0)
+        return;
+
+    std::vector<int> hot;
+    for (int pos = lruHead; pos != -1; pos = cache[pos].next)
+        hot.push_back(cache[pos].nodeIndex);
+
+    int pages = ((int)hot.size() + WARMUP_IDS_PER_PAGE - 1) / WARMUP_IDS_PER_PAGE;
+    while ((int)manifestPages.size() < pages)
+    {
+        int index = header.nextFree();
+        if (index < 0)
+            return;
+        manifestPages.push_back(index);
+    }
+    while ((int)manifestPages.size() > pages)
+    {
+        header.freeIndex(manifestPages.back());
+        manifestPages.pop_back();
+    }
+
+    char page[PAGE_SIZE];
+    for (int p = 0; p < pages; p++)
+    {
+        int first = p * WARMUP_IDS_PER_PAGE;
+        int head[3] = {WARMUP_MAGIC, std::min(WARMUP_IDS_PER_PAGE, (int)hot.size() - first),
+                       p + 1 < pages ? manifestPages[p + 1] : 0};
+
+        memset(page, 0, PAGE_SIZE);
+        memcpy(page, head, WARMUP_HEADER_SIZE);
+        memcpy(page + WARMUP_HEADER_SIZE, hot.data() + first, sizeof(int) * head[1]);
+        pager.writePage(manifestPages[p], page);
+    }
+
+    /* the header goes out with the rest of the sync, or from BTree at close */
+    int first = pages > 0 ? manifestPages[0] : 0;
+    if (header.warmupPage != first)
+        header.warmupPage = first, header.isDirty = true;
+}
+
+/* reads the manifest left by the last session and frees its pages, hottest page first */
+std::vector<int> NodeCache::readManifest()
+{
+    std::vector<int> hot;
+    std::unordered_set<int> seen;
+    char page[PAGE_SIZE];
+
+    for (int index = header.warmupPage; index > 0 && seen.insert(index).second;)
+    {
+        pager.getPage(page, index);
+
+        int head[3];
+        memcpy(head, page, WARMUP_HEADER_SIZE);
+        if (head[0] != WARMUP_MAGIC || head[1] < 0 || head[1] > WARMUP_IDS_PER_PAGE)
+            break;
+
+        /* node pages can't start with the magic, so this page really is ours to free */
+        header.freeIndex(index);
+
+        const int *ids = (const int *)(page + WARMUP_HEADER_SIZE);
+        hot.insert(hot.end(), ids, ids + head[1]);
+        index = head[2];
+    }
+
+    if (header.warmupPage != 0)
+        header.warmupPage = 0, header.isDirty = true;
+    return hot;
+}
+
+/* pages allocated outside the trees: the warm-up manifest, and retired pages snapshots may still read */
+std::vector<int> NodeCache::reservedPages()
+{
+    std::vector<int> pages(manifestPages);
+    for (auto &page : retired)
+        pages.push_back(page.second);
+    return pages;
+}
+
+/* drops this session's manifest, e.g. when truncate frees every page */
+void NodeCache::releaseManifest()
+{
+    for (int index : manifestPages)
+        header.freeIndex(index);
+    manifestPages.clear();
+
+    if (header.warmupPage != 0)
+        header.warmupPage = 0, header.isDirty = true;
+}
+
+/*
+reads back the pages the last session listed in its manifest, up to the cache
+size and hottest first, so the cache starts out warm.
+*/
+void NodeCache::warmUp()
+{
+    if (isInMemMode || pager.fd < 0)
+        return;
+
+    std::vector<int> hot = readManifest();
+    if ((int)hot.size() > capacity)
+        hot.resize(capacity);
+
+    int filePages = pager.pageCount();
+    std::vector<int> wanted;
+    for (int index : hot)
+    {
+        if (index > 0 && index < filePages && header.isAllocated(index) && nodeIndexToCachePos.count(index) == 0)
+            wanted.push_back(index);
+    }
+    loadPages(wanted, false, WARMUP_MAX_GAP);
+
+    /* hottest page ends up at the head of the lru list */
+    for (auto it = hot.rbegin(); it != hot.rend(); ++it)
+    {
+        auto cached = nodeIndexToCachePos.find(*it);
+        if (cached != nodeIndexToCachePos.end())
+            updateLru(cached->second);
+    }
+}
+
+/*
+a scan is about to visit these pages. direct I/O leaves the kernel nothing to
+read ahead, so the ones that aren't cached are read here, up to a quarter of
+the cache.
+*/
+void NodeCache::readAhead(const int *pages, int count)
+{
+    if (!pager.direct || isInMemMode || pager.fd < 0)
+        return;
+
+    int limit = std::min(SCAN_READAHEAD_PAGES, capacity / 4);
+    std::vector<int> wanted;
+    for (int i = 0; i < count && (int)wanted.size() < limit; i++)
+    {
+        int index = resolve(pages[i]);
+        if (index > 0 && index < MAX_PAGE_COUNT && nodeIndexToCachePos.count(index) == 0)
+            wanted.push_back(index);
+    }
+
+    /* a single page is read just as well by get. direct reads pay for every page, so gaps aren't read through */
+    if (wanted.size() > 1)
+        loadPages(wanted, true, 1);
+}
+
+/*
+reads pages into frames in file order, pages up to maxGap apart in one large
+read per run with the gaps read through, and tells the kernel about every run
+up front so the reads overlap. a page is only installed if it still holds its
+node. without evict only free frames are filled.
+*/
+void NodeCache::loadPages(std::vector<int> &wanted, bool evict, int maxGap)
+{
+    std::sort(wanted.begin(), wanted.end());
+    wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+    /* [first page, page count, first wanted, end of wanted] */
+    struct Run
+    {
+        int first, count;
+        size_t begin, end;
+    };
+    std::vector<Run> runs;
+    for (size_t i = 0; i < wanted.size();)
+    {
+        Run run = {wanted[i], 1, i, i + 1};
+        while (run.end < wanted.size() && wanted[run.end] - wanted[run.end - 1] <= maxGap &&
+               wanted[run.end] - run.first < WARMUP_RUN_PAGES)
+            run.end++;
+
+        run.count = wanted[run.end - 1] - run.first + 1;
+        runs.push_back(run);
+        i = run.end;
+    }
+
+    for (const Run &run : runs)
+        pager.prefetch(run.first, run.count);
+
+    /* page aligned, so direct reads go straight into it */
+    if (runBuffer == nullptr)
+    {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, PAGE_SIZE, (size_t)WARMUP_RUN_PAGES * PAGE_SIZE) != 0)
+            throw std::bad_alloc();
+        runBuffer = (char *)memory;
+    }
+    char scratch[PAGE_SIZE];
+
+    for (const Run &run : runs)
+    {
+        pager.readPages(runBuffer, run.first, run.count);
+
+        for (size_t i = run.begin; i < run.end && (evict || !freeFrames.empty()); i++)
+        {
+            const char *raw = PageCodec::decodePage(runBuffer + (size_t)(wanted[i] - run.first) * PAGE_SIZE, scratch);
+            if (raw == nullptr)
+                continue;
+
+            int cachePos = evict ? findFreeCacheSlot() : freeFrames.back();
+            if (!evict)
+                freeFrames.pop_back();
+
+            BTreeNode *node = deserializeNode(raw, cache[cachePos].memory);
+            if (node == nullptr || node->index != wanted[i])
+            {
+                if (node != nullptr)
+                    node->~BTreeNode();
+                freeFrames.push_back(cachePos);
+                continue;
+            }
+
+            install(cachePos, node, false);
+        }
+    }
+}
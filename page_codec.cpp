@@ -0,0 +1,224 @@
+#include "btree.h"
+
+/*
+a small LZ77 block codec in the spirit of LZ4. the input is a run of
+sequences, each one a token byte (literal length in the high nibble, match
+length - LZ_MIN_MATCH in the low nibble), optional length extension bytes,
+the literals, then a two byte match offset. the last sequence carries only
+literals. zero padded KeyValue data compresses to a handful of bytes.
+*/
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lzHash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static bool putLength(uint8_t *out, int &op, int cap, int len)
+{
+    while (len >= 255)
+    {
+        if (op >= cap)
+            return false;
+        out[op++] = 255;
+        len -= 255;
+    }
+    if (op >= cap)
+        return false;
+    out[op++] = (uint8_t)len;
+    return true;
+}
+
+static bool getLength(const uint8_t *in, int &ip, int len, int &value)
+{
+    int b;
+    do
+    {
+        if (ip >= len)
+            return false;
+        b = in[ip++];
+        value += b;
+    } while (b == 255);
+    return true;
+}
+
+static bool emitSequence(uint8_t *out, int &op, int cap, const uint8_t *lit, int litLen, int offset, int matchLen)
+{
+    if (op >= cap)
+        return false;
+
+    int token = op++;
+    int litNibble = litLen < 15 ? litLen : 15;
+    int matchNibble = 0;
+
+    if (litLen >= 15 && !putLength(out, op, cap, litLen - 15))
+        return false;
+
+    if (op + litLen > cap)
+        return false;
+    memcpy(out + op, lit, litLen);
+    op += litLen;
+
+    if (matchLen > 0)
+    {
+        int extra = matchLen - LZ_MIN_MATCH;
+        matchNibble = extra < 15 ? extra : 15;
+
+        if (op + 2 > cap)
+            return false;
+        out[op++] = (uint8_t)(offset & 0xff);
+        out[op++] = (uint8_t)(offset >> 8);
+
+        if (extra >= 15 && !putLength(out, op, cap, extra - 15))
+            return false;
+    }
+
+    out[token] = (uint8_t)((litNibble << 4) | matchNibble);
+    return true;
+}
+
+/* returns the compressed size, or -1 if it would not fit in dstCap */
+int PageCodec::compress(const char *src, int srcLen, char *dst, int dstCap)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    while (ip + LZ_MIN_MATCH <= srcLen)
+    {
+        uint32_t h = lzHash(in + ip);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < srcLen && in[ref + len] == in[ip + len])
+            len++;
+
+        if (!emitSequence(out, op, dstCap, in + anchor, ip - anchor, ip - ref, len))
+            return -1;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!emitSequence(out, op, dstCap, in + anchor, srcLen - anchor, 0, 0))
+        return -1;
+
+    return op;
+}
+
+/* returns the decompressed size, or -1 on malformed input */
+int PageCodec::decompress(const char *src, int srcLen, char *dst, int dstCap)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    int ip = 0, op = 0;
+
+    while (ip < srcLen)
+    {
+        int token = in[ip++];
+        int litLen = token >> 4;
+
+        if (litLen == 15 && !getLength(in, ip, srcLen, litLen))
+            return -1;
+        if (ip + litLen > srcLen || op + litLen > dstCap)
+            return -1;
+
+        memcpy(out + op, in + ip, litLen);
+        ip += litLen;
+        op += litLen;
+
+        if (ip == srcLen)
+            break;
+
+        if (ip + 2 > srcLen)
+            return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+
+        int matchLen = token & 0x0f;
+        if (matchLen == 15 && !getLength(in, ip, srcLen, matchLen))
+            return -1;
+        matchLen += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + matchLen > dstCap)
+            return -1;
+
+        /* byte at a time, matches may overlap their own output */
+        for (int i = 0; i < matchLen; i++, op++)
+            out[op] = out[op - offset];
+    }
+
+    return op;
+}
+
+/*
+encodes a serialized node into a page image. returns the number of bytes of
+the page that are in use, pages that do not compress are stored raw.
+*/
+int PageCodec::encodePage(int codec, const char *raw, char page[PAGE_SIZE])
+{
+    if (codec == COMPRESSION_LZ)
+    {
+        int len = compress(raw, PAGE_SIZE, page + COMPRESSED_HEADER_SIZE, PAGE_SIZE - COMPRESSED_HEADER_SIZE);
+        if (len > 0)
+        {
+            int tag = COMPRESSED_PAGE_TAG;
+            std::memcpy(page, &tag, sizeof(int));
+            std::memcpy(page + sizeof(int), &codec, sizeof(int));
+            std::memcpy(page + 2 * sizeof(int), &len, sizeof(int));
+
+            int used = COMPRESSED_HEADER_SIZE + len;
+            std::memset(page + used, 0, PAGE_SIZE - used);
+            return used;
+        }
+    }
+
+    std::memcpy(page, raw, PAGE_SIZE);
+    return PAGE_SIZE;
+}
+
+/*
+returns the serialized node held by a page image, either the page itself
+when it is stored raw or scratch holding the decompressed node.
+*/
+const char *PageCodec::decodePage(const char *page, char scratch[PAGE_SIZE])
+{
+    int tag, codec, len;
+    std::memcpy(&tag, page, sizeof(int));
+
+    /* raw node pages start with their own (positive) page index */
+    if (tag != COMPRESSED_PAGE_TAG)
+        return page;
+
+    std::memcpy(&codec, page + sizeof(int), sizeof(int));
+    std::memcpy(&len, page + 2 * sizeof(int), sizeof(int));
+
+    if (codec != COMPRESSION_LZ || len <= 0 || len > (int)(PAGE_SIZE - COMPRESSED_HEADER_SIZE))
+    {
+        std::cerr << "Unknown page codec: " << codec << std::endl;
+        return nullptr;
+    }
+
+    if (decompress(page + COMPRESSED_HEADER_SIZE, len, scratch, PAGE_SIZE) != PAGE_SIZE)
+    {
+        std::cerr << "Corrupt compressed page" << std::endl;
+        return nullptr;
+    }
+
+    return scratch;
+}
@@ -1,33 +1,168 @@
 #include "btree.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <sys/stat.h>
+
+/*
+O_DIRECT wants the memory aligned as well as the offset and length. the cache
+frames' buffers are, anything else is copied through this per thread buffer.
+*/
+static char *alignedBuffer(size_t bytes)
+{
+    struct Bounce
+    {
+        char *data = nullptr;
+        size_t size = 0;
+        ~Bounce() { free(data); }
+    };
+    thread_local Bounce bounce;
+
+    if (bounce.size < bytes)
+    {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, PAGE_SIZE, bytes) != 0)
+            throw std::bad_alloc();
+
+        free(bounce.data);
+        bounce.data = (char *)memory;
+        bounce.size = bytes;
+    }
+    return bounce.data;
+}
+
+static bool isAligned(const char *buffer)
+{
+    return ((uintptr_t)buffer & (PAGE_SIZE - 1)) == 0;
+}
 
 bool Pager::open(const char *filename)
 {
-    std::ifstream checkFile(filename);
-    bool fileExists = checkFile.good();
-    checkFile.close();
+    bool fileExists = access(filename, F_OK) == 0;
+
+    int flags = O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+    if (direct)
+        flags |= O_DIRECT;
+#endif
 
-    file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
-    if (!file)
+    fd = ::open(filename, flags, 0644);
+    if (fd < 0 && direct && errno == EINVAL)
     {
-        file.clear();
-        file.open(filename, std::ios::out | std::ios::binary);
-        file.close();
-        file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
+        std::cerr << "Direct I/O isn't supported for " << filename << ", using the page cache" << std::endl;
+        direct = false;
+        fd = ::open(filename, O_RDWR | O_CREAT, 0644);
     }
+
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct statfs fs;
+    blockSize = (fstatfs(fd, &fs) == 0 && fs.f_bsize > 0) ? fs.f_bsize : PAGE_SIZE;
+
     return fileExists;
 }
 
+/* an unlinked file in TMPDIR for memory mode to spill nodes to, it goes away with the descriptor */
+bool Pager::openTemporary()
+{
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir != nullptr ? dir : "/tmp") + "/btree-spill-XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+
+    fd = mkstemp(name.data());
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create a spill file in " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    unlink(name.data());
+
+    struct statfs fs;
+    blockSize = (fstatfs(fd, &fs) == 0 && fs.f_bsize > 0) ? fs.f_bsize : PAGE_SIZE;
+    return true;
+}
+
 void Pager::getPage(char buffer[PAGE_SIZE], int index)
 {
-    file.seekg(PAGE_SIZE * index, std::ios::beg);
-    file.read(buffer, PAGE_SIZE);
+    /* memory mode runs without a file */
+    if (fd < 0)
+    {
+        memset(buffer, 0, PAGE_SIZE);
+        return;
+    }
+
+    bool bounce = direct && !isAligned(buffer);
+    char *target = bounce ? alignedBuffer(PAGE_SIZE) : buffer;
+
+    ssize_t n = pread(fd, target, PAGE_SIZE, (off_t)PAGE_SIZE * index);
+    if (n < 0)
+        n = 0;
+    if (bounce)
+        memcpy(buffer, target, n);
+
+    stats.add(STAT_PAGES_READ);
+    stats.add(STAT_BYTES_READ, n);
+
+    /* reading past the end of the file yields an empty page */
+    if (n < PAGE_SIZE)
+        memset(buffer + n, 0, PAGE_SIZE - n);
+}
+
+/* one read for a run of consecutive pages */
+void Pager::readPages(char *buffer, int first, int count)
+{
+    size_t len = (size_t)PAGE_SIZE * count;
+
+    if (fd < 0)
+    {
+        memset(buffer, 0, len);
+        return;
+    }
+
+    bool bounce = direct && !isAligned(buffer);
+    char *target = bounce ? alignedBuffer(len) : buffer;
+
+    ssize_t n = pread(fd, target, len, (off_t)PAGE_SIZE * first);
+    if (n < 0)
+        n = 0;
+    if (bounce)
+        memcpy(buffer, target, n);
+
+    stats.add(STAT_PAGES_READ, count);
+    stats.add(STAT_BYTES_READ, n);
+
+    if ((size_t)n < len)
+        memset(buffer + n, 0, len - n);
+}
+
+/* pages currently in the file, including the header */
+int Pager::pageCount()
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return 0;
+
+    return (int)((st.st_size + PAGE_SIZE - 1) / PAGE_SIZE);
 }
 
 void Pager::writePage(int index, char *buffer)
 {
-    file.seekp(PAGE_SIZE * index, std::ios::beg);
-    file.write(buffer, PAGE_SIZE);
-    file.flush();
+    if (fd < 0)
+        return;
+
+    if (direct && !isAligned(buffer))
+        buffer = (char *)memcpy(alignedBuffer(PAGE_SIZE), buffer, PAGE_SIZE);
+
+    if (pwrite(fd, buffer, PAGE_SIZE, (off_t)PAGE_SIZE * index) != PAGE_SIZE)
+        std::cerr << "Failed to write page " << index << ": " << strerror(errno) << std::endl;
+
+    stats.add(STAT_PAGES_WRITTEN);
+    stats.add(STAT_BYTES_WRITTEN, PAGE_SIZE);
 }
 
 /*
@@ -35,24 +170,80 @@ for when we mark multiple pages as dirty in a single op
 */
 void Pager::writePages(int index, char *buffer)
 {
-    file.seekp(PAGE_SIZE * index, std::ios::beg);
-    file.write(buffer, PAGE_SIZE);
+    writePage(index, buffer);
+}
+
+/*
+release the unused tail of a compressed page back to the filesystem. only
+whole filesystem blocks can be freed, so on filesystems whose block size is
+the page size this is a no-op.
+*/
+void Pager::punchHole(int index, int used)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (blockSize >= PAGE_SIZE)
+        return;
+
+    int start = ((used + blockSize - 1) / blockSize) * blockSize;
+    if (start >= PAGE_SIZE)
+        return;
+
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)PAGE_SIZE * index + start, PAGE_SIZE - start);
+#endif
+}
+
+/* asks the kernel to start reading pages in the background, readPages picks them up later */
+void Pager::prefetch(int first, int count)
+{
+    /* direct reads skip the page cache, so there is nothing for the kernel to fill */
+    if (fd < 0 || direct)
+        return;
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, (off_t)PAGE_SIZE * first, (off_t)PAGE_SIZE * count, POSIX_FADV_WILLNEED);
+#endif
 }
 
 void Pager::flush()
 {
-    file.flush();
+    /* pwrite hands pages straight to the kernel, nothing is buffered here */
+}
+
+/* makes every write so far durable */
+void Pager::sync()
+{
+    if (fd < 0)
+        return;
+
+    fdatasync(fd);
+    stats.add(STAT_SYNCS);
 }
 
 void Pager::cleanup()
 {
-    if (file.is_open())
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+/* cuts the file back to its first pages */
+void Pager::truncate(int pages)
+{
+    if (fd < 0)
+        return;
+
+    if (ftruncate(fd, (off_t)PAGE_SIZE * pages) != 0)
     {
-        file.close();
+        std::cerr << "Failed to truncate database file: " << strerror(errno) << std::endl;
+        return;
     }
+    sync();
 }
 
 void Pager::deleteFile()
 {
-    file.close();
-}
\ No newline at end of file
+    cleanup();
+}
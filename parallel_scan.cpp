@@ -0,0 +1,179 @@
+#include "btree.h"
+
+ParallelScan::ParallelScan(BTree &tree, int count)
+    : btree(tree), threads(count), sink(nullptr), stolen(0)
+{
+    if (threads <= 0)
+        threads = std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+/* scans the tree under root into out, false if the sink failed. damaged pages are only reported to the sink */
+bool ParallelScan::run(int root, ScanSink &out)
+{
+    sink = &out;
+    stolen = 0;
+    workers.clear();
+    workers.emplace_back(new Worker());
+
+    std::vector<UpperNode> upper;
+    split(root, upper);
+
+    if (!sink->begin((int)tasks.size()))
+        return false;
+
+    for (UpperNode &visit : upper)
+        sink->node(0, *visit.node, visit.task.depth, visit.task.lower, visit.task.upper);
+
+    /* neighbouring subtrees tend to sit in neighbouring pages, so each worker starts on a run of them */
+    int count = std::min(threads, (int)tasks.size());
+    while ((int)workers.size() < count)
+        workers.emplace_back(new Worker());
+
+    for (size_t i = 0; i < tasks.size(); i++)
+        workers[i * count / tasks.size()]->tasks.push_back((int)i);
+
+    if (count == 1)
+    {
+        work(0);
+    }
+    else
+    {
+        std::vector<std::thread> pool;
+        for (int i = 0; i < count; i++)
+            pool.emplace_back(&ParallelScan::work, this, i);
+        for (std::thread &worker : pool)
+            worker.join();
+    }
+
+    return sink->finish();
+}
+
+/* reads the upper levels a level at a time until there are enough subtrees to go round */
+void ParallelScan::split(int root, std::vector<UpperNode> &upper)
+{
+    Task whole = {root, 0, LLONG_MIN, LLONG_MAX, false, KeyValue()};
+    tasks.assign(1, whole);
+
+    size_t wanted = (size_t)threads * SCAN_TASKS_PER_THREAD;
+    bool expanded = true;
+
+    while (expanded && tasks.size() < wanted)
+    {
+        expanded = false;
+        std::vector<Task> next;
+
+        for (const Task &task : tasks)
+        {
+            /* leaves are read again by their worker, which also reports a damaged page */
+            std::unique_ptr<BTreeNode> node(new BTreeNode(true, task.index, btree));
+            if (task.depth >= SCAN_MAX_DEPTH || !readNode(*workers[0], task.index, node.get()) || node->isLeaf)
+            {
+                next.push_back(task);
+                continue;
+            }
+
+            for (int i = 0; i <= node->numKeys; i++)
+            {
+                Task child;
+                child.index = node->children[i];
+                child.depth = task.depth + 1;
+                child.lower = i == 0 ? task.lower : node->keys[i - 1].key;
+                child.upper = i == node->numKeys ? task.upper : node->keys[i].key;
+                child.hasNext = i < node->numKeys || task.hasNext;
+                child.next = i < node->numKeys ? node->keys[i] : task.next;
+                next.push_back(child);
+            }
+
+            upper.push_back(UpperNode{task, std::move(node)});
+            expanded = true;
+        }
+
+        tasks.swap(next);
+    }
+}
+
+void ParallelScan::work(int id)
+{
+    Worker &worker = *workers[id];
+    int task;
+
+    while (take(id, &task))
+    {
+        const Task &job = tasks[task];
+        walk(worker, task, job.index, job.depth, job.lower, job.upper);
+        if (job.hasNext)
+            sink->entry(task, job.next);
+    }
+}
+
+/* the next task from the front of our own run, or else from the back of someone else's */
+bool ParallelScan::take(int id, int *task)
+{
+    int count = (int)workers.size();
+    for (int i = 0; i < count; i++)
+    {
+        Worker &victim = *workers[(id + i) % count];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (victim.tasks.empty())
+            continue;
+
+        if (i == 0)
+        {
+            *task = victim.tasks.front();
+            victim.tasks.pop_front();
+        }
+        else
+        {
+            *task = victim.tasks.back();
+            victim.tasks.pop_back();
+            stolen++;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* hands the subtree to the sink in key order, a node before its children */
+void ParallelScan::walk(Worker &worker, int partition, int index, int depth, long long lower, long long upper)
+{
+    if (depth >= SCAN_MAX_DEPTH)
+    {
+        sink->damaged(partition, index, depth);
+        return;
+    }
+
+    while ((int)worker.nodes.size() <= depth)
+        worker.nodes.emplace_back(new BTreeNode(true, 0, btree));
+
+    BTreeNode &node = *worker.nodes[depth];
+    if (!readNode(worker, index, &node))
+    {
+        sink->damaged(partition, index, depth);
+        return;
+    }
+
+    sink->node(partition, node, depth, lower, upper);
+
+    for (int i = 0; i <= node.numKeys; i++)
+    {
+        if (!node.isLeaf)
+        {
+            walk(worker, partition, node.children[i], depth + 1, i == 0 ? lower : node.keys[i - 1].key,
+                 i == node.numKeys ? upper : node.keys[i].key);
+        }
+
+        if (i < node.numKeys && !node.isDeleted(i))
+            sink->entry(partition, node.keys[i]);
+    }
+}
+
+/* a page that doesn't decode, or holds another page's node, counts as damaged */
+bool ParallelScan::readNode(Worker &worker, int index, BTreeNode *node)
+{
+    if (index <= 0 || index >= MAX_PAGE_COUNT)
+        return false;
+
+    btree.pager().getPage(worker.page, index);
+    const char *raw = PageCodec::decodePage(worker.page, worker.scratch);
+    return raw != nullptr && NodeCache::decodeNode(raw, node) && node->index == index;
+}
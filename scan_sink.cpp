@@ -0,0 +1,276 @@
+#include "btree.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static bool writeAll(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buffer, len);
+        if (n <= 0)
+            return false;
+
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+ExportSink::~ExportSink()
+{
+    closeParts();
+}
+
+bool ExportSink::begin(int partitions)
+{
+    closeParts();
+    failed = false;
+    total = 0;
+
+    for (int i = 0; i < partitions; i++)
+        parts.emplace_back(new Part());
+    return true;
+}
+
+void ExportSink::entry(int partition, const KeyValue &kv)
+{
+    Part &part = *parts[partition];
+    part.keys++;
+
+    if (format == EXPORT_BINARY)
+    {
+        part.buffer.append((const char *)&kv.key, sizeof(int));
+        part.buffer.append(kv.data, DATA_SIZE);
+    }
+    else
+    {
+        /* values are strings, quoted when they hold a separator */
+        const char *end = (const char *)memchr(kv.data, 0, DATA_SIZE);
+        size_t len = end != nullptr ? end - kv.data : DATA_SIZE;
+        bool quote = false;
+        for (size_t i = 0; i < len && !quote; i++)
+            quote = strchr(",\"\r\n", kv.data[i]) != nullptr;
+
+        part.buffer += std::to_string(kv.key);
+        part.buffer += quote ? ",\"" : ",";
+        for (size_t i = 0; i < len; i++)
+        {
+            if (kv.data[i] == '"')
+                part.buffer += '"';
+            part.buffer += kv.data[i];
+        }
+        part.buffer += quote ? "\"\n" : "\n";
+    }
+
+    if (part.buffer.size() >= EXPORT_BUFFER_SIZE)
+        flush(partition);
+}
+
+void ExportSink::damaged(int partition, int index, int depth)
+{
+    std::cerr << "Export skipped damaged page " << index << std::endl;
+    failed = true;
+}
+
+/* moves a partition's buffer to its temporary file, which is unlinked as soon as it is open */
+void ExportSink::flush(int partition)
+{
+    Part &part = *parts[partition];
+
+    if (part.spill < 0)
+    {
+        std::string name = path + ".part" + std::to_string(partition);
+        part.spill = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (part.spill >= 0)
+            unlink(name.c_str());
+    }
+
+    if (part.spill < 0 || !writeAll(part.spill, part.buffer.data(), part.buffer.size()))
+        failed = true;
+    part.buffer.clear();
+}
+
+bool ExportSink::finish()
+{
+    int out = failed ? -1 : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out >= 0;
+
+    if (ok && format == EXPORT_BINARY)
+    {
+        int head[2] = {EXPORT_MAGIC, (int)DATA_SIZE};
+        ok = writeAll(out, (const char *)head, sizeof(head));
+    }
+    else if (ok)
+    {
+        ok = writeAll(out, "key,value\n", 10);
+    }
+
+    std::vector<char> chunk(EXPORT_BUFFER_SIZE);
+    for (size_t i = 0; ok && i < parts.size(); i++)
+    {
+        Part &part = *parts[i];
+        total += part.keys;
+
+        if (part.spill >= 0)
+        {
+            lseek(part.spill, 0, SEEK_SET);
+            ssize_t n;
+            while (ok && (n = read(part.spill, chunk.data(), chunk.size())) > 0)
+                ok = writeAll(out, chunk.data(), n);
+        }
+        ok = ok && writeAll(out, part.buffer.data(), part.buffer.size());
+    }
+
+    ok = ok && fsync(out) == 0;
+    if (out >= 0)
+        close(out);
+    closeParts();
+
+    if (!ok)
+        std::cerr << "Failed to export to " << path << std::endl;
+    return ok;
+}
+
+void ExportSink::closeParts()
+{
+    for (auto &part : parts)
+    {
+        if (part->spill >= 0)
+            close(part->spill);
+    }
+    parts.clear();
+}
+
+VerifySink::VerifySink(Header &header)
+    : header(header), seen(new std::atomic<uint8_t>[MAX_PAGES]), problemCount(0), keyCount(0), pageCount(0)
+{
+    for (int i = 0; i < MAX_PAGE_COUNT; i++)
+        seen[i].store(0, std::memory_order_relaxed);
+}
+
+bool VerifySink::begin(int partitions)
+{
+    parts.clear();
+    for (int i = 0; i < partitions; i++)
+        parts.emplace_back(new Part());
+    return true;
+}
+
+void VerifySink::node(int partition, const BTreeNode &node, int depth, long long lower, long long upper)
+{
+    Part &part = *parts[partition];
+    part.pages++;
+
+    std::string page = "page " + std::to_string(node.index);
+
+    if (!header.isAllocated(node.index))
+        report(page + " is in a tree but free in the header");
+    if (seen[node.index].exchange(1))
+        report(page + " is reached more than once");
+
+    /*
+    the root may hold fewer keys, but only an empty tree has a root without any.
+    appends leave the right edge short until the next remove
+    */
+    if (depth > 0 && node.numKeys < t - 1 && upper != LLONG_MAX)
+        report(page + " holds " + std::to_string(node.numKeys) + " keys, fewer than t - 1");
+    if (node.numKeys > 2 * t - 1)
+        report(page + " holds " + std::to_string(node.numKeys) + " keys, more than 2t - 1");
+    if (depth == 0 && !node.isLeaf && node.numKeys == 0)
+        report(page + " is an empty inner root");
+
+    for (int i = 0; i < node.numKeys; i++)
+    {
+        int k = node.keys[i].key;
+        if (k <= lower || k >= upper)
+            report(page + " holds key " + std::to_string(k) + " outside its parent's range");
+        if (i > 0 && k <= node.keys[i - 1].key)
+            report(page + " holds key " + std::to_string(k) + " out of order");
+    }
+
+    if (node.isLeaf)
+    {
+        if (part.leafDepth < 0)
+            part.leafDepth = depth;
+        else if (part.leafDepth != depth)
+            report(page + " is a leaf at depth " + std::to_string(depth) + ", others are at " +
+                   std::to_string(part.leafDepth));
+    }
+}
+
+void VerifySink::entry(int partition, const KeyValue &kv)
+{
+    Part &part = *parts[partition];
+    if (part.haveLast && kv.key <= part.last)
+        report("key " + std::to_string(kv.key) + " comes after " + std::to_string(part.last));
+
+    part.haveLast = true;
+    part.last = kv.key;
+    part.keys++;
+}
+
+void VerifySink::damaged(int partition, int index, int depth)
+{
+    report("page " + std::to_string(index) + " at depth " + std::to_string(depth) + " can't be read");
+}
+
+/* the partitions of one tree have to agree on the leaf depth */
+bool VerifySink::finish()
+{
+    int leafDepth = -1;
+    for (auto &part : parts)
+    {
+        keyCount += part->keys;
+        pageCount += part->pages;
+
+        if (part->leafDepth < 0)
+            continue;
+        if (leafDepth >= 0 && part->leafDepth != leafDepth)
+            report("leaves at depth " + std::to_string(part->leafDepth) + " and " + std::to_string(leafDepth));
+        leafDepth = part->leafDepth;
+    }
+
+    parts.clear();
+    return ok();
+}
+
+/* every allocated page has to belong to a tree scanned so far or be one of reserved */
+void VerifySink::checkAllocation(const std::vector<int> &reserved)
+{
+    std::vector<int> pages(reserved);
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    for (int index : pages)
+    {
+        if (index <= 0 || index >= MAX_PAGE_COUNT)
+            continue;
+
+        if (seen[index].exchange(1))
+            report("page " + std::to_string(index) + " is in a tree and also holds metadata");
+        if (!header.isAllocated(index))
+            report("page " + std::to_string(index) + " holds metadata but is free in the header");
+    }
+
+    int leaked = 0;
+    int first = 0;
+    for (int i = 1; i < MAX_PAGE_COUNT; i++)
+    {
+        if (header.isAllocated(i) && !seen[i].load(std::memory_order_relaxed))
+        {
+            if (leaked++ == 0)
+                first = i;
+        }
+    }
+
+    if (leaked > 0)
+        report(std::to_string(leaked) + " allocated pages are not reachable, the first is " + std::to_string(first));
+}
+
+void VerifySink::report(const std::string &problem)
+{
+    std::lock_guard<std::mutex> lock(problemLock);
+    problemCount++;
+    if ((int)found.size() < VERIFY_MAX_PROBLEMS)
+        found.push_back(problem);
+}
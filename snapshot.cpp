@@ -0,0 +1,87 @@
+#include "btree.h"
+
+Snapshot::Snapshot(BTree &tree, int rootIndex, uint64_t version)
+    : btree(&tree), root(rootIndex), ver(version)
+{
+}
+
+Snapshot::Snapshot(Snapshot &&other)
+    : btree(other.btree), root(other.root), ver(other.ver)
+{
+    other.btree = nullptr;
+}
+
+Snapshot::~Snapshot()
+{
+    if (btree != nullptr)
+        btree->releaseSnapshot(ver);
+}
+
+/* reads a committed page without going through the NodeCache, which belongs to the writer */
+bool Snapshot::readNode(int index, BTreeNode *node)
+{
+    char page[PAGE_SIZE];
+    char scratch[PAGE_SIZE];
+
+    btree->pager().getPage(page, index);
+
+    const char *raw = PageCodec::decodePage(page, scratch);
+    return raw != nullptr && NodeCache::decodeNode(raw, node);
+}
+
+bool Snapshot::get(int k, char *result)
+{
+    BTreeNode node(true, root, *btree);
+    int index = root;
+
+    while (index > 0 && readNode(index, &node))
+    {
+        int i = node.findKey(k);
+
+        if (i < node.numKeys && node.keys[i].key == k)
+        {
+            if (node.isDeleted(i))
+                return false;
+
+            memcpy(result, node.keys[i].data, DATA_SIZE);
+            return true;
+        }
+
+        if (node.isLeaf)
+            return false;
+
+        index = node.children[i];
+    }
+
+    return false;
+}
+
+/* calls fn for every key in [lo, hi] in order, until fn returns false */
+void Snapshot::scan(int lo, int hi, const ScanFn &fn)
+{
+    if (root > 0)
+        scanNode(root, lo, hi, fn);
+}
+
+bool Snapshot::scanNode(int index, int lo, int hi, const ScanFn &fn)
+{
+    BTreeNode node(true, index, *btree);
+    if (!readNode(index, &node))
+        return false;
+
+    int i = node.findKey(lo);
+
+    for (; i <= node.numKeys; i++)
+    {
+        if (!node.isLeaf && !scanNode(node.children[i], lo, hi, fn))
+            return false;
+
+        if (i == node.numKeys || node.keys[i].key > hi)
+            break;
+
+        if (!node.isDeleted(i) && !fn(node.keys[i].key, node.keys[i].data))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,190 @@
+#include "btree.h"
+
+static const char *counterNames[STAT_COUNT] = {
+    "cache_hits",
+    "cache_misses",
+    "tier_hits",
+    "evictions",
+    "writebacks",
+    "pages_read",
+    "pages_written",
+    "bytes_read",
+    "bytes_written",
+    "syncs",
+    "splits",
+    "merges",
+    "filter_skips",
+};
+
+static const char *opNames[STAT_OP_COUNT] = {
+    "get",
+    "insert",
+    "remove",
+    "scan",
+};
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    counts[bucketOf(ns)]++;
+    total++;
+    if (ns > maxNs)
+        maxNs = ns;
+}
+
+void LatencyHistogram::add(int bucket, uint64_t count)
+{
+    counts[bucket] += count;
+    total += count;
+}
+
+/* upper bound of the bucket holding the q-th quantile, so at most 1/16 over */
+uint64_t LatencyHistogram::percentile(double q) const
+{
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)std::ceil(q * total);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        seen += counts[b];
+        if (seen >= rank)
+            return std::min(upperBound(b), maxNs);
+    }
+    return maxNs;
+}
+
+int LatencyHistogram::bucketOf(uint64_t ns)
+{
+    if (ns < HISTOGRAM_SUB_BUCKETS)
+        return (int)ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    int sub = (int)((ns >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::upperBound(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+double StatsSnapshot::hitRatio() const
+{
+    uint64_t lookups = counters[STAT_CACHE_HITS] + counters[STAT_CACHE_MISSES];
+    return lookups == 0 ? 0.0 : (double)counters[STAT_CACHE_HITS] / lookups;
+}
+
+/* one JSON object per line */
+void StatsSnapshot::print(std::ostream &out) const
+{
+    char buffer[256];
+
+    out << "{";
+    for (int c = 0; c < STAT_COUNT; c++)
+        out << "\"" << counterNames[c] << "\":" << counters[c] << ",";
+
+    snprintf(buffer, sizeof(buffer), "\"hit_ratio\":%.4f", hitRatio());
+    out << buffer;
+
+    for (int op = 0; op < STAT_OP_COUNT; op++)
+    {
+        const LatencyHistogram &h = latency[op];
+        snprintf(buffer, sizeof(buffer),
+                 ",\"%s\":{\"count\":%llu,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}",
+                 opNames[op], (unsigned long long)h.count(), h.percentile(0.50) / 1000.0,
+                 h.percentile(0.99) / 1000.0, h.percentile(0.999) / 1000.0, h.max() / 1000.0);
+        out << buffer;
+    }
+    out << "}" << std::endl;
+}
+
+Stats::Stats() : dumpOut(nullptr), dumpIntervalNs(0), nextDump(0)
+{
+    for (int s = 0; s < STATS_SHARDS; s++)
+    {
+        for (int c = 0; c < STAT_COUNT; c++)
+            shards[s].values[c].store(0, std::memory_order_relaxed);
+    }
+
+    for (int op = 0; op < STAT_OP_COUNT; op++)
+    {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+            buckets[op][b].store(0, std::memory_order_relaxed);
+        maxLatency[op].store(0, std::memory_order_relaxed);
+    }
+}
+
+/* threads are spread over the shards round robin as they first count something */
+int Stats::shardIndex()
+{
+    static std::atomic<int> nextShard(0);
+    static thread_local int shard = nextShard.fetch_add(1, std::memory_order_relaxed) % STATS_SHARDS;
+    return shard;
+}
+
+uint64_t Stats::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void Stats::recordLatency(StatOp op, uint64_t ns)
+{
+    buckets[op][LatencyHistogram::bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    if (ns > maxLatency[op].load(std::memory_order_relaxed))
+        maxLatency[op].store(ns, std::memory_order_relaxed);
+}
+
+StatsSnapshot Stats::snapshot() const
+{
+    StatsSnapshot snap;
+
+    for (int c = 0; c < STAT_COUNT; c++)
+    {
+        snap.counters[c] = 0;
+        for (int s = 0; s < STATS_SHARDS; s++)
+            snap.counters[c] += shards[s].values[c].load(std::memory_order_relaxed);
+    }
+
+    for (int op = 0; op < STAT_OP_COUNT; op++)
+    {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        {
+            uint64_t count = buckets[op][b].load(std::memory_order_relaxed);
+            if (count > 0)
+                snap.latency[op].add(b, count);
+        }
+        snap.latency[op].setMax(maxLatency[op].load(std::memory_order_relaxed));
+    }
+
+    return snap;
+}
+
+/* prints a snapshot to out every intervalMs, checked as operations finish. a null out turns it off */
+void Stats::setDump(std::ostream *out, int intervalMs)
+{
+    dumpOut = intervalMs > 0 ? out : nullptr;
+    dumpIntervalNs = (uint64_t)intervalMs * 1000000;
+    nextDump = now() + dumpIntervalNs;
+}
+
+void Stats::maybeDump(uint64_t now)
+{
+    if (dumpOut == nullptr || now < nextDump)
+        return;
+
+    nextDump = now + dumpIntervalNs;
+    snapshot().print(*dumpOut);
+}
@@ -0,0 +1,103 @@
+#include "btree.h"
+
+static const char *traceNames[TRACE_TYPE_COUNT] = {
+    "split",
+    "merge",
+    "borrow_prev",
+    "borrow_next",
+    "evict",
+    "get",
+    "insert",
+    "remove",
+    "scan",
+};
+
+/* keeps the last events, rounded up to a power of two */
+void Tracer::enable(size_t events)
+{
+    size_t capacity = 1;
+    while (capacity < events)
+        capacity <<= 1;
+
+    slots.reset(new Slot[capacity]);
+    for (size_t i = 0; i < capacity; i++)
+        slots[i].seq.store(0, std::memory_order_relaxed);
+
+    mask = capacity - 1;
+    head.store(0, std::memory_order_relaxed);
+    epoch = Stats::now();
+}
+
+/* instant events leave start at 0 and take the time themselves */
+void Tracer::record(int type, int page, int arg, uint64_t start, uint64_t end)
+{
+    if (!slots)
+        return;
+
+    if (start == 0)
+        start = end = Stats::now();
+
+    uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = slots[n & mask];
+
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.event.ts = start;
+    slot.event.dur = end - start;
+    slot.event.type = type;
+    slot.event.depth = (type == TRACE_EVICT || type >= TRACE_GET) ? -1 : depth;
+    slot.event.page = page;
+    slot.event.arg = arg;
+
+    slot.seq.store(n + 1, std::memory_order_release);
+}
+
+/* writes the buffered events, oldest first, as Chrome trace JSON (chrome://tracing or Perfetto) */
+void Tracer::exportChromeTrace(std::ostream &out)
+{
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    uint64_t end = slots ? head.load(std::memory_order_acquire) : 0;
+    uint64_t begin = end > mask + 1 ? end - (mask + 1) : 0;
+    bool first = true;
+    char buffer[256];
+
+    for (uint64_t n = begin; n < end; n++)
+    {
+        Slot &slot = slots[n & mask];
+        if (slot.seq.load(std::memory_order_acquire) != n + 1)
+            continue;
+
+        TraceEvent event = slot.event;
+
+        /* overwritten while we copied it */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != n + 1)
+            continue;
+
+        double ts = (event.ts - epoch) / 1000.0;
+        const char *name = event.type >= 0 && event.type < TRACE_TYPE_COUNT ? traceNames[event.type] : "unknown";
+
+        if (event.type >= TRACE_GET)
+        {
+            snprintf(buffer, sizeof(buffer),
+                     "{\"name\":\"%s\",\"cat\":\"op\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":1,\"tid\":1,\"args\":{\"key\":%d}}",
+                     name, ts, event.dur / 1000.0, event.arg);
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer),
+                     "{\"name\":\"%s\",\"cat\":\"tree\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                     "\"pid\":1,\"tid\":1,\"args\":{\"page\":%d,\"%s\":%d,\"depth\":%d}}",
+                     name, ts, event.page, event.type == TRACE_EVICT ? "dirty" : "other",
+                     event.arg, event.depth);
+        }
+
+        out << (first ? "" : ",\n") << buffer;
+        first = false;
+    }
+
+    out << "]}" << std::endl;
+}
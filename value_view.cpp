@@ -0,0 +1,41 @@
+#include "btree.h"
+
+ValueView::ValueView(NodeCache &nodeCache, BTreeNode *frame, const char *data)
+    : cache(&nodeCache), node(frame), value(data)
+{
+    cache->pin(node->index);
+}
+
+ValueView::ValueView(ValueView &&other)
+    : cache(other.cache), node(other.node), value(other.value)
+{
+    other.cache = nullptr;
+    other.node = nullptr;
+    other.value = nullptr;
+}
+
+ValueView &ValueView::operator=(ValueView &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        cache = other.cache;
+        node = other.node;
+        value = other.value;
+        other.cache = nullptr;
+        other.node = nullptr;
+        other.value = nullptr;
+    }
+    return *this;
+}
+
+/* unpins by the node's current index, copy-on-write may have moved it since */
+void ValueView::reset()
+{
+    if (cache != nullptr)
+        cache->unpin(node->index);
+
+    cache = nullptr;
+    node = nullptr;
+    value = nullptr;
+}
@@ -0,0 +1,61 @@
+#include "btree.h"
+
+/*
+holds up to messages inserts and removes in memory before they go to the tree,
+0 turns the buffer off and applies what it holds. buffered writes reach the file
+at the next flush, so a crash loses them. copy-on-write commits every operation
+on its own and doesn't buffer.
+*/
+void BTree::setWriteBuffer(int messages)
+{
+    if (messages > 0 && cache.isCopyOnWrite())
+        std::cerr << "Copy-on-write mode doesn't buffer writes" << std::endl;
+
+    bufferLimit = std::max(0, messages);
+    if (bufferLimit == 0)
+        flushWrites();
+}
+
+/* a later message for the same key replaces the earlier one, data is nullptr for a remove */
+void BTree::enqueue(int k, const char *data, bool remove)
+{
+    Message &message = pending[k];
+    message.remove = remove;
+    if (!remove)
+        memcpy(message.data, data, DATA_SIZE);
+
+    if ((int)pending.size() >= bufferLimit)
+        flushWrites();
+}
+
+/*
+applies the buffered messages in key order. neighbouring keys land in leaves
+that are still cached from the message before, and the pages they dirty are
+written once by the sync at the end instead of once per message.
+*/
+void BTree::flushWrites()
+{
+    if (pending.empty())
+        return;
+
+    std::map<int, Message> batch;
+    batch.swap(pending);
+
+    for (auto &entry : batch)
+    {
+        if (entry.second.remove)
+        {
+            erase(entry.first, false);
+            continue;
+        }
+
+        const char *data = entry.second.data;
+        store(entry.first, [data](char *value, bool) {
+            memcpy(value, data, DATA_SIZE);
+            return true;
+        }, false);
+    }
+
+    cache.sync();
+    commitChanges();
+}